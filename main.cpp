@@ -2,6 +2,11 @@
  * Example application for testing the gosu raycaster engine - a simple shooter game
  */
 #include "raycaster.hpp"
+#include "recorder.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
 
 #define RCMapData Gosu::RayCaster::MapData
 
@@ -15,14 +20,16 @@ public:
         SPACE = 0,
         WALL = 1,
         ENTRANCE = 2,
-        BADGUY = 3
+        BADGUY = 3,
+        WINDOW = 4
     };
     
-    Map() :
-        _floor(Gosu::Image(L"./assets/floor.jpg").getData().toBitmap()),
-        _carpet(Gosu::Image(L"./assets/carpet.png").getData().toBitmap()),
-        _wall(Gosu::Image(L"./assets/wall.jpg"))
-
+    // Textures are only queued here; they show as placeholders until the registry finishes them
+    Map(Gosu::TextureRegistry& textures) :
+        _floor(textures.load(L"./assets/floor.jpg")),
+        _carpet(textures.load(L"./assets/carpet.png")),
+        _wall(textures.load(L"./assets/wall.jpg")),
+        _baddie(textures.load(L"./assets/baddie.png"))
     {}
     
     // One X to the right of entrance is player start
@@ -44,13 +51,21 @@ public:
             unsigned xy = _coordToIndex(x,y);
             switch(_map[xy]) {
                 case WALL:
-                    result.wall = &_wall;
+                    result.wall_handle = _wall;
+                    break;
+                case WINDOW:
+                    // A wall with a gap you can see (and shoot) through
+                    result.wall_handle = _wall;
+                    result.wall_height = 0.3;
+                    result.ceiling_height = 0.8;
+                    result.ceiling_handle = _carpet;
+                    result.floor_handle = _floor;
                     break;
                 case ENTRANCE:
                 case SPACE:
                 case BADGUY:
-                    result.ceiling = &_carpet;
-                    result.floor = &_floor;
+                    result.ceiling_handle = _carpet;
+                    result.floor_handle = _floor;
                     
                     break;
             }
@@ -60,7 +75,11 @@ public:
     }
     
     const bool checkCollision(const int x, const int y) {
-        return _map[_coordToIndex(x,y)] == 1;
+        if(x<0 || y<0 || x >= Map::MAP_WIDTH || y >= Map::MAP_HEIGHT) {
+            return true;
+        }
+        int at_tile = _map[_coordToIndex(x,y)];
+        return at_tile == WALL || at_tile == WINDOW;
     }
     
     
@@ -71,7 +90,7 @@ public:
             if(_map[xy] == 3) {
                 std::pair<unsigned, unsigned> coord = _indexToCoord(xy);
                 Gosu::RayCaster::Sprite sprite;
-                sprite.texture = new Gosu::Image(L"./assets/baddie.png");
+                dressSprite(sprite, BADGUY);
                 sprite.x = coord.first;
                 sprite.y = coord.second;
                 result.push_back(sprite);
@@ -81,6 +100,15 @@ public:
     }
     
     
+    // Give a sprite the texture for its kind of tile. Replays use this to put textures back on recorded sprites.
+    void dressSprite(Gosu::RayCaster::Sprite& sprite, const unsigned tag) {
+        sprite.tag = tag;
+        if(tag == BADGUY) {
+            sprite.texture_handle = _baddie;
+        }
+    }
+    
+    
     int testHit(std::pair<double, double> position, std::pair<double, double> coord_system, std::vector<Gosu::RayCaster::Sprite>& sprites) {
         float x = position.first;
         float y = position.second;
@@ -124,7 +152,7 @@ private:
         1, 2, 0, 1, 0, 0, 0, 0, 0, 0, 0, 1,
         1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
         1, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 1,
-        1, 0, 0, 1, 1, 1, 1, 0, 1, 0, 3, 1,
+        1, 0, 0, 1, 4, 4, 1, 0, 1, 0, 3, 1,
         1, 0, 0, 1, 0, 0, 3, 0, 1, 0, 0, 1,
         1, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 1,
         1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1,
@@ -132,87 +160,101 @@ private:
         1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1
     };
     
-    Gosu::Image _wall;
-    Gosu::Bitmap _floor, _carpet;
+    Gosu::TextureHandle _floor, _carpet, _wall, _baddie;
 };
 
 class Window : public Gosu::Window {
 public:
-    Window() : Gosu::Window(800, 600, false),
-        _gun1(L"./assets/gun1.png"),
-        _gun2(L"./assets/gun2.png")
+    // Frames are written to 'record_to' as they are drawn, unless it is empty
+    Window(const std::string& record_to, const double budget_ms) : Gosu::Window(800, 600, false),
+        _map(_textures),
+        _gun1(_textures.load(L"./assets/gun1.png")),
+        _gun2(_textures.load(L"./assets/gun2.png"))
     {
         setCaption(L"RayCast");
+        _caster.setTextureRegistry(&_textures);
         _caster.setCameraPosition(_map.getPlayerStart());
         _caster.setCoordinateSystem(0,1); // Face 100% south
+        _simulation.setState(_caster.getCameraState());
+        if(budget_ms > 0) {
+            _caster.setFrameTimeBudget(budget_ms);
+        }
         _timer = Gosu::milliseconds();
         
         _map_response = [this](int x, int y) -> RCMapData {
             return _map.getMapData(x,y);
         };
         
-        _collision_detector = [this](double x, double y)  -> bool {
-            return _map.checkCollision((int)x,(int)y);
+        _collision_detector = [this](int x, int y)  -> bool {
+            return _map.checkCollision(x,y);
         };
         
         _sprites = _map.getSprites();
         
-        _gun = &_gun1;
+        _gun = _gun1;
+        
+        if(!record_to.empty() && !_recorder.open(record_to)) {
+            fprintf(stderr, "Couldn't record to %s\n", record_to.c_str());
+        }
     }
     
     void draw() {
+        // Render partway between simulation ticks, so motion is smooth whatever the frame rate
+        _caster.setCameraState(_simulation.interpolated());
         _caster.draw(this, _map_response, _sprites);
-        float gun_scale = (this->graphics().width() / _gun->width())/3;
-        _gun->draw(this->graphics().width() / 2, this->graphics().height() - (_gun->height() * gun_scale), 1, gun_scale, gun_scale);
+        _recorder.record(0, _caster.getFrameTime(), _caster.getQuality(), _caster.getCameraState(), _sprites);
+        
+        // Scaling is worked out from the real texture, so the placeholder isn't drawn in its place
+        if(_textures.ready(_gun)) {
+            Gosu::Image * gun = _textures.image(_gun);
+            float gun_scale = (this->graphics().width() / gun->width())/3;
+            gun->draw(this->graphics().width() / 2, this->graphics().height() - (gun->height() * gun_scale), 1, gun_scale, gun_scale);
+        }
     }
     
     
     void update() {
+        // Bring in any textures that finished loading
+        _textures.update();
+        
         // Time elapsed since last frame
         float delta = Gosu::milliseconds() - _timer;
         _timer = Gosu::milliseconds();
         
-        // Scaled controls
-        float turn_speed = 0.08 * delta;
-        float pitch_speed = 0.001 * delta;
-        float walk_speed = 0.002 * delta;
-        float bob_speed = delta * 0.0003;
+        // The keys only say what the player wants; the simulation moves the camera in fixed ticks
+        Gosu::CameraInput input;
         
         // Turn camera on y axis
         if (Gosu::Input::down(Gosu::kbA)) {
-            _caster.rotateCamera(-turn_speed);
+            input.turn = -1;
         } else if (Gosu::Input::down(Gosu::kbD)) {
-            _caster.rotateCamera(turn_speed);
+            input.turn = 1;
         }
         
         // Tilt camera on its x axis
         if (Gosu::Input::down(Gosu::kbQ)) {
-            _caster.pitchCamera(pitch_speed);
+            input.pitch = 1;
         } else if (Gosu::Input::down(Gosu::kbW)) {
-            _caster.pitchCamera(-pitch_speed);
+            input.pitch = -1;
         }
         
         // Walking. Forward steps bob the camera
         if (Gosu::Input::down(Gosu::kbUp)) {
-            _caster.transformCamera(walk_speed, 0, _collision_detector);
-            _caster.setCameraBobRange(0.03);
-        } else {
-            // Quickly return to a bob of 0 in a smooth motion
-            _caster.setCameraBobRange(0);
-            
-            // Walk backwards
-            if (Gosu::Input::down(Gosu::kbDown)) {
-                _caster.transformCamera(-walk_speed,0, _collision_detector);
-            }
+            input.forward = 1;
+        } else if (Gosu::Input::down(Gosu::kbDown)) {
+            input.forward = -1;
         }
         
         // Strafe
         if (Gosu::Input::down(Gosu::kbLeft)) {
-            _caster.transformCamera(0,-walk_speed, _collision_detector);
+            input.strafe = -1;
         } else if (Gosu::Input::down(Gosu::kbRight)) {
-            _caster.transformCamera(0,walk_speed, _collision_detector);
+            input.strafe = 1;
         }
         
+        _simulation.setInput(input);
+        _simulation.advance(delta / 1000.0, _collision_detector);
+        
         
         if(_guncooldown > 0) {
             _guncooldown -= delta;
@@ -224,38 +266,123 @@ public:
                 _guntimer -= delta;
                 if(_guntimer <= 0) {
                     _guntimer = 0;
-                    _gun = &_gun1;
+                    _gun = _gun1;
                     _guncooldown = 100;
                 }
             } else if(Gosu::Input::down(Gosu::kbSpace)) {
                 
-                int hit = _map.testHit(_caster.getCameraPosition(), _caster.getCoordinateSystem(), _sprites);
+                const Gosu::CameraState& camera = _simulation.getState();
+                int hit = _map.testHit(std::make_pair(camera.x, camera.y), std::make_pair(camera.dir_x, camera.dir_y), _sprites);
                 if(hit >= 0) {
                     _sprites.erase(_sprites.begin() + hit);
                 }
                 
                 _guntimer = 200;
-                _gun = &_gun2;
+                _gun = _gun2;
             }
         }
-        
-        _caster.bobCamera(bob_speed);
     }
     
 private:
+    Gosu::TextureRegistry _textures;
     Map _map;
     Gosu::RayCaster _caster;
+    Gosu::CameraSimulation _simulation;
+    Gosu::FrameRecorder _recorder;
     unsigned long _timer;
     std::vector<Gosu::RayCaster::Sprite> _sprites;
     std::function <RCMapData(int, int)> _map_response;
-    std::function <bool(double, double)> _collision_detector;
-    Gosu::Image * _gun;
-    Gosu::Image _gun1, _gun2;
+    Gosu::CameraSimulation::SolidQuery _collision_detector;
+    Gosu::TextureHandle _gun;
+    Gosu::TextureHandle _gun1, _gun2;
     unsigned long  _guntimer;
     unsigned long _guncooldown;
 };
 
-int main() {
-    Window win;
-    win.show();
+// Plays a recording back as fast as it will go, printing each frame's timings (and optionally a hash of what was
+// drawn) as CSV, then quits. Slow frames from a recorded session become a repeatable benchmark.
+class ReplayWindow : public Gosu::Window {
+public:
+    ReplayWindow(const std::string& filename, const bool hash) : Gosu::Window(800, 600, false, 1),
+        _map(_textures)
+    {
+        setCaption(L"RayCast Replay");
+        _caster.setTextureRegistry(&_textures);
+        _caster.setFrameHashing(hash);
+        
+        _map_response = [this](int x, int y) -> RCMapData {
+            return _map.getMapData(x,y);
+        };
+        
+        // Timings shouldn't include textures popping in
+        _textures.finish();
+        
+        _ok = _replay.open(filename);
+        if(!_ok) {
+            fprintf(stderr, "Couldn't read a recording from %s\n", filename.c_str());
+        } else {
+            printf("frame,map_version,total_ns,wall_pass_ns,wall_sprite_pass_ns,sprite_pass_ns,background_ns,map_queries,dda_steps,subimage_allocations,image_hash\n");
+        }
+    }
+    
+    void draw() {
+        Gosu::FrameRecord record;
+        if(!_ok || !_replay.next(record)) {
+            close();
+            return;
+        }
+        
+        for(auto& sprite: record.sprites) {
+            _map.dressSprite(sprite, sprite.tag);
+        }
+        
+        // Animations run at the recorded time and quality, so the frame comes out the same as it did live
+        _caster.setFrameTime(record.frame_time);
+        _caster.setQuality(record.quality);
+        _caster.setCameraState(record.camera);
+        _caster.draw(this, _map_response, record.sprites);
+        
+        const Gosu::RayCaster::FrameStats& stats = _caster.getFrameStats();
+        printf("%lu,%u,%llu,%llu,%llu,%llu,%llu,%lu,%lu,%lu,%016llx\n", _replay.getFrameCount(), record.map_version,
+               stats.total_ns, stats.wall_pass_ns, stats.wall_sprite_pass_ns, stats.sprite_pass_ns, stats.background_ns,
+               stats.map_queries, stats.dda_steps, stats.subimage_allocations, stats.image_hash);
+    }
+    
+private:
+    Gosu::TextureRegistry _textures;
+    Map _map;
+    Gosu::RayCaster _caster;
+    Gosu::FrameReplay _replay;
+    std::function <RCMapData(int, int)> _map_response;
+    bool _ok;
+};
+
+// fps.out                      play
+// fps.out --record FILE        play, recording every frame to FILE
+// fps.out --budget MS          play, trading quality for speed to keep frames under MS milliseconds
+// fps.out --replay FILE [--hash]   re-render FILE as a benchmark
+int main(int argc, char ** argv) {
+    std::string record_to, replay_from;
+    bool hash = false;
+    double budget_ms = 0;
+    for(int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if(arg == "--record" && i + 1 < argc) {
+            record_to = argv[++i];
+        } else if(arg == "--replay" && i + 1 < argc) {
+            replay_from = argv[++i];
+        } else if(arg == "--hash") {
+            hash = true;
+        } else if(arg == "--budget" && i + 1 < argc) {
+            budget_ms = atof(argv[++i]);
+        }
+    }
+    
+    if(!replay_from.empty()) {
+        ReplayWindow win(replay_from, hash);
+        win.show();
+    } else {
+        Window win(record_to, budget_ms);
+        win.show();
+    }
 };
@@ -2,6 +2,11 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <tuple>
 
 enum DrawPass {
     FIRST_PASS = 0,
@@ -28,29 +33,357 @@ double _camera_pitch;
 double _camera_bob_current;
 double _camera_bob_range;
 int _camera_bob_direction;
+double _camera_height;  // Eye level in world units; walls are 1.0 tall by default
 
 Gosu::Bitmap _ceiling_floor;
 
+Gosu::TextureRegistry * _textures;  // Where MapData and Sprite handles are looked up
+unsigned long _texture_generation;  // Registry generation the sprite stripe cache was filled under
+
+// The frame being drawn, for animations and procedural textures
+unsigned long _frame_number;
+double _frame_seconds;
+double _fixed_frame_seconds;    // From setFrameTime; negative follows the real clock
+
+// Profiling
+Gosu::RayCaster::FrameStats _stats;
+std::ofstream _trace;
+bool _trace_started;                    // Anything written yet; events after the first need a separator
+std::unique_ptr<Gosu::Image> _fps_image;
+int _fps_shown;
+bool _hashing;                          // Build up _frame_hash while drawing
+unsigned long long _frame_hash;
+
+// Sprite stripes already cut from their textures, by source image, column, and the frame's top and height
+typedef std::tuple<const Gosu::ImageData *, int, int, int> StripeKey;
+std::map<StripeKey, std::unique_ptr<Gosu::ImageData>> _stripe_cache;
+
+// Rows of a column still open past some distance, recorded by the wall pass each time short walls, steps or
+// window frames narrow it. Sprites are drawn in front of every wall, so they are clipped to these instead.
+struct Occlusion {
+    double dist;
+    int clip_top;
+    int clip_bottom;
+};
+std::vector<Occlusion> _occlusions;     // Every column's, one after another, in order of distance
+
+// Quality, and the frame time governor that adjusts it
+Gosu::RayCaster::QualitySettings _quality;
+double _frame_budget_ms;                // 0 when the governor is off
+unsigned _quality_level;                // Rung of QUALITY_LADDER the governor is on
+std::chrono::steady_clock::time_point _last_draw;
+bool _drawn_before;
+double _window_ms;                      // Frame times summed since the governor last made a decision
+unsigned _window_frames;
+double _average_frame_ms;
+
 // ----
 
+typedef std::chrono::steady_clock Clock;
+
+static unsigned long long nanosecondsBetween(const Clock::time_point start, const Clock::time_point end) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+}
+
+// Add one event to the trace file, if there is one
+static void traceEvent(const std::string& event) {
+    if(_trace.is_open()) {
+        _trace << (_trace_started ? ",\n" : "[\n") << event;
+        _trace_started = true;
+    }
+}
+
+// Mix one value into the frame hash (FNV-1a), when hashing is on
+static void hashValue(const long long value) {
+    if(_hashing) {
+        for(int i = 0; i < 8; i++) {
+            _frame_hash ^= (value >> (i * 8)) & 0xff;
+            _frame_hash *= 1099511628211ULL;
+        }
+    }
+}
+
+// A complete ('X') event in the trace for a phase of the frame
+static void tracePhase(const char * name, const Clock::time_point start, const unsigned long long duration_ns) {
+    unsigned long long start_us = std::chrono::duration_cast<std::chrono::microseconds>(start.time_since_epoch()).count();
+    traceEvent(std::string("{\"name\":\"") + name + "\",\"cat\":\"draw\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" +
+               std::to_string(start_us) + ",\"dur\":" + std::to_string(duration_ns / 1000.0) + "}");
+}
+
+// Most stripes the cache holds before it starts over - enough for plenty of animated sprites on screen
+static const size_t STRIPE_CACHE_LIMIT = 16384;
+
+// Sprite stripes that are partly hidden start and end on one of this many bands of their frame's rows. Otherwise
+// the rows cut would change as the camera crept past a ledge, and every frame would cut new stripes.
+static const int STRIPE_CLIP_BANDS = 16;
+
+// One texel wide column of a sprite frame, cut only the first time it is needed
+static Gosu::ImageData * spriteStripe(const Gosu::Image * texture, const int column, const int top, const int height, const bool clipped) {
+    StripeKey key(&texture->getData(), column, top, height);
+    auto found = _stripe_cache.find(key);
+    if(found != _stripe_cache.end()) {
+        _stats.stripe_cache_hits++;
+        return found->second.get();
+    }
+    
+    if(_stripe_cache.size() >= STRIPE_CACHE_LIMIT) {
+        _stripe_cache.clear();
+    }
+    _stats.subimage_allocations++;
+    if(clipped) {
+        _stats.stripe_clip_misses++;
+    }
+    Gosu::ImageData * stripe = texture->getData().subimage(column, top, 1, height).release();
+    _stripe_cache[key].reset(stripe);
+    return stripe;
+}
+
+// The settings the governor steps between, best first. Each rung gives up a little more than the one before,
+// starting with what costs the least to look at.
+struct QualityRung {
+    unsigned column_step;
+    unsigned flat_row_step;
+    double max_distance;
+    unsigned sprite_stripe_step;
+};
+static const QualityRung QUALITY_LADDER[] = {
+    { 1, 1, 0, 1 },
+    { 1, 2, 0, 1 },
+    { 1, 2, 0, 2 },
+    { 2, 2, 0, 2 },
+    { 2, 2, 24, 2 },
+    { 2, 3, 16, 3 },
+    { 3, 3, 16, 3 },
+    { 4, 4, 12, 4 }
+};
+static const unsigned QUALITY_LEVELS = sizeof(QUALITY_LADDER) / sizeof(QUALITY_LADDER[0]);
+
+// Frames averaged before each decision, so a single hitch doesn't swing the quality around
+static const unsigned GOVERNOR_WINDOW = 20;
+
+// A gap this long between draws is a stall (loading, a dragged window) rather than rendering cost, so it isn't counted
+static const double GOVERNOR_STALL_MS = 250;
+
+// Raise quality only once frames come in under this share of the budget, so it doesn't flip back and forth
+static const double GOVERNOR_HEADROOM = 0.8;
+
+// Switch to a rung of the ladder, returning the QualityKnob bits of what changed
+static unsigned applyQualityLevel(const unsigned level) {
+    const QualityRung& rung = QUALITY_LADDER[level];
+    unsigned changes = 0;
+    if(rung.column_step != _quality.column_step) changes |= Gosu::RayCaster::QUALITY_RESOLUTION;
+    if(rung.flat_row_step != _quality.flat_row_step) changes |= Gosu::RayCaster::QUALITY_FLAT_SAMPLING;
+    if(rung.max_distance != _quality.max_distance) changes |= Gosu::RayCaster::QUALITY_RAY_DISTANCE;
+    if(rung.sprite_stripe_step != _quality.sprite_stripe_step) changes |= Gosu::RayCaster::QUALITY_SPRITE_LOD;
+    
+    _quality_level = level;
+    _quality.column_step = rung.column_step;
+    _quality.flat_row_step = rung.flat_row_step;
+    _quality.max_distance = rung.max_distance;
+    _quality.sprite_stripe_step = rung.sprite_stripe_step;
+    return changes;
+}
+
+// Measure the time since the last draw and, when a window of frames is complete, step quality down if it ran over
+// budget or up if there was room. Fills in the quality parts of the stats.
+static void governFrameTime(const Clock::time_point now) {
+    unsigned changes = 0;
+    if(_drawn_before && _frame_budget_ms > 0) {
+        double frame_ms = std::chrono::duration_cast<std::chrono::microseconds>(now - _last_draw).count() / 1000.0;
+        if(frame_ms < GOVERNOR_STALL_MS) {
+            _window_ms += frame_ms;
+            _window_frames++;
+        }
+        
+        if(_window_frames >= GOVERNOR_WINDOW) {
+            _average_frame_ms = _window_ms / _window_frames;
+            _window_ms = 0;
+            _window_frames = 0;
+            
+            unsigned level = _quality_level;
+            if(_average_frame_ms > _frame_budget_ms && level + 1 < QUALITY_LEVELS) {
+                level++;
+            } else if(_average_frame_ms < _frame_budget_ms * GOVERNOR_HEADROOM && level > 0) {
+                level--;
+            }
+            
+            if(level != _quality_level) {
+                changes = applyQualityLevel(level);
+            }
+        }
+    }
+    _last_draw = now;
+    _drawn_before = true;
+    
+    _stats.quality = _quality;
+    _stats.quality_changes = changes;
+    _stats.average_frame_ms = _average_frame_ms;
+}
+
+// Note the open rows of the column whose occlusions start at 'first', after it narrowed at 'dist'
+static void recordOcclusion(const size_t first, const double dist, const int clip_top, const int clip_bottom) {
+    if(_occlusions.size() > first) {
+        Occlusion& last = _occlusions.back();
+        if(last.clip_top == clip_top && last.clip_bottom == clip_bottom) {
+            return;
+        }
+        if(last.dist == dist) {
+            last.clip_top = clip_top;
+            last.clip_bottom = clip_bottom;
+            return;
+        }
+    }
+    Occlusion occlusion = { dist, clip_top, clip_bottom };
+    _occlusions.push_back(occlusion);
+}
+
+// Narrow 'top' and 'bottom' to the rows of a column left open by everything in front of 'dist'
+static void clipToOcclusions(const size_t first, const size_t count, const double dist, int& top, int& bottom) {
+    auto begin = _occlusions.begin() + first;
+    auto nearest = std::lower_bound(begin, begin + count, dist, [](const Occlusion& occlusion, const double d) {
+        return occlusion.dist < d;
+    });
+    if(nearest != begin) {
+        --nearest;
+        top = std::max(top, nearest->clip_top);
+        bottom = std::min(bottom, nearest->clip_bottom);
+    }
+}
+
+// Which frame of an animation is showing for a tile 'phase' (0.0-1.0) of the way through its cycle
+static Gosu::TextureHandle animationFrame(const Gosu::AnimatedTexture * animation, const float phase) {
+    if(animation->frames.empty()) {
+        return Gosu::TextureHandle();
+    }
+    long count = animation->frames.size();
+    long frame = (long)floor(_frame_seconds * animation->frames_per_second + phase * count);
+    return animation->frames[((frame % count) + count) % count];
+}
+
+// Fill in any textures that were supplied as handles, animations or procedural textures, so that drawing only
+// deals in images and bitmaps. Procedural textures are brought up to date here, so only the ones actually hit
+// this frame do any work.
+static void resolveTextures(Gosu::RayCaster::MapData& data) {
+    if(data.wall == NULL && data.wall_procedural) {
+        data.wall_procedural->refresh(_frame_number, _frame_seconds);
+        data.wall = data.wall_procedural->image();
+    }
+    if(data.floor == NULL && data.floor_procedural) {
+        data.floor_procedural->refresh(_frame_number, _frame_seconds);
+        data.floor = data.floor_procedural->bitmap();
+    }
+    if(data.ceiling == NULL && data.ceiling_procedural) {
+        data.ceiling_procedural->refresh(_frame_number, _frame_seconds);
+        data.ceiling = data.ceiling_procedural->bitmap();
+    }
+    
+    if(_textures == NULL) {
+        return;
+    }
+    if(data.wall == NULL) {
+        data.wall = _textures->image(data.wall_animation ? animationFrame(data.wall_animation, data.animation_phase) : data.wall_handle);
+    }
+    if(data.floor == NULL) {
+        data.floor = _textures->bitmap(data.floor_animation ? animationFrame(data.floor_animation, data.animation_phase) : data.floor_handle);
+    }
+    if(data.ceiling == NULL) {
+        data.ceiling = _textures->bitmap(data.ceiling_animation ? animationFrame(data.ceiling_animation, data.animation_phase) : data.ceiling_handle);
+    }
+}
+
 Gosu::RayCaster::RayCaster() {
     _ready = false;
     _camera_pitch = 0.0;
     _camera_bob_current = 0.0;
     _camera_bob_range = 0.0;
     _camera_bob_direction = 1;
+    _camera_height = 0.5;
     _plane_x = 0.66;
     _plane_y = 0.00;
     _dir_x = 0;
     _dir_y = -1;
     _rotation = 0;
     _fps_enabled = false;
+    _textures = NULL;
+    _texture_generation = 0;
+    _frame_number = 0;
+    _frame_seconds = 0;
+    _fixed_frame_seconds = -1;
+    _trace_started = false;
+    _fps_shown = -1;
+    _hashing = false;
+    _frame_budget_ms = 0;
+    _quality_level = 0;
+    _drawn_before = false;
+    _window_ms = 0;
+    _window_frames = 0;
+    _average_frame_ms = 0;
 }
 
 void Gosu::RayCaster::setDisplayFPS(const bool enable) {
     _fps_enabled = enable;
 }
 
+const Gosu::RayCaster::FrameStats& Gosu::RayCaster::getFrameStats() {
+    return _stats;
+}
+
+void Gosu::RayCaster::setTraceFile(const std::string& filename) {
+    if(_trace.is_open()) {
+        _trace << (_trace_started ? "\n]\n" : "[]\n");
+        _trace.close();
+    }
+    
+    _trace_started = false;
+    if(!filename.empty()) {
+        _trace.open(filename.c_str(), std::ios::out | std::ios::trunc);
+    }
+}
+
+void Gosu::RayCaster::setFrameHashing(const bool enable) {
+    _hashing = enable;
+}
+
+void Gosu::RayCaster::setQuality(const QualitySettings& quality) {
+    _frame_budget_ms = 0;
+    _quality = quality;
+    _quality.column_step = std::max(1u, _quality.column_step);
+    _quality.flat_row_step = std::max(1u, _quality.flat_row_step);
+    _quality.sprite_stripe_step = std::max(1u, _quality.sprite_stripe_step);
+}
+
+const Gosu::RayCaster::QualitySettings& Gosu::RayCaster::getQuality() {
+    return _quality;
+}
+
+void Gosu::RayCaster::setFrameTimeBudget(const double milliseconds) {
+    _frame_budget_ms = std::max(0.0, milliseconds);
+    _window_ms = 0;
+    _window_frames = 0;
+    
+    // The governor starts at full quality and works down from there
+    if(_frame_budget_ms > 0) {
+        applyQualityLevel(0);
+    }
+}
+
+void Gosu::RayCaster::setFrameTime(const double seconds) {
+    _fixed_frame_seconds = seconds;
+}
+
+const double Gosu::RayCaster::getFrameTime() {
+    return _frame_seconds;
+}
+
+void Gosu::RayCaster::clearSpriteCache() {
+    _stripe_cache.clear();
+}
+
+void Gosu::RayCaster::setTextureRegistry(TextureRegistry * registry) {
+    _textures = registry;
+    _texture_generation = registry ? registry->getGeneration() : 0;
+}
+
 void Gosu::RayCaster::setCameraPosition(const double x, const double y) {
     _ready = true;
     
@@ -172,10 +505,218 @@ const double Gosu::RayCaster::getCameraPitch() {
     return _camera_pitch;
 }
 
+void Gosu::RayCaster::setCameraHeight(const double height) {
+    _camera_height = height;
+}
+
+const double Gosu::RayCaster::getCameraHeight() {
+    return _camera_height;
+}
+
+void Gosu::RayCaster::setCameraState(const CameraState& state) {
+    setCameraPosition(state.x, state.y);
+    setCoordinateSystem(state.dir_x, state.dir_y);
+    setCameraPitch(state.pitch);
+    setCameraHeight(state.height);
+    _camera_bob_current = Gosu::clamp<double>(state.bob, -0.5, 0.5);
+    _camera_bob_direction = state.bob_direction;
+}
+
+const Gosu::CameraState Gosu::RayCaster::getCameraState() {
+    CameraState state;
+    state.x = _pos_x;
+    state.y = _pos_y;
+    state.dir_x = _dir_x;
+    state.dir_y = _dir_y;
+    state.pitch = _camera_pitch;
+    state.bob = _camera_bob_current;
+    state.bob_direction = _camera_bob_direction;
+    state.height = _camera_height;
+    return state;
+}
+
+// --- Column helpers for the wall pass. Heights are in world units, rows are screen pixels. ---
+
+// What a single screen column needs to know to draw itself
+struct ColumnView {
+    int x;
+    int width;          // Screen columns this ray fills, more than one when casting at reduced resolution
+    unsigned screen_h;
+    double horizon;     // Screen row level with the camera's eye
+    double ray_dir_x;
+    double ray_dir_y;
+    float z;
+};
+
+// The screen row that a height at some distance lands on. Rows grow downward.
+static double rowAt(const ColumnView& view, const double height, const double dist) {
+    return view.horizon - (height - _camera_height) * view.screen_h / fmax(dist, 0.0001);
+}
+
+// First whole row at or below a projected row, kept on screen
+static int clampRow(const ColumnView& view, const double row) {
+    return (int)ceil(Gosu::clamp<double>(row, 0, view.screen_h));
+}
+
+// The background bitmap has a column per ray and a row per flat_row_step screen rows, and is stretched over the
+// screen. These are the bitmap rows that screen rows 'first' to 'last' touch.
+static int firstBackgroundRow(const int first) {
+    return first / (int)_quality.flat_row_step;
+}
+
+static int endBackgroundRow(const int last) {
+    return (last + _quality.flat_row_step - 1) / _quality.flat_row_step;
+}
+
+// The screen row a background row is sampled at, kept inside screen rows 'first' to 'last'
+static int sampleRow(const int row, const int first, const int last) {
+    return Gosu::clamp<int>(row * _quality.flat_row_step, first, last - 1);
+}
+
+// Set this column's pixel on one row of the background bitmap
+static void putPixel(const ColumnView& view, const int row, const Gosu::Color color) {
+    _ceiling_floor.setPixel(view.x / _quality.column_step, row, color);
+}
+
+// One darkened texel of a floor, ceiling or step
+static Gosu::Color shadeTexel(const Gosu::Bitmap * texture, const double u, const double v, const double dist) {
+    if(texture == NULL) {
+        return Gosu::Color::NONE;
+    }
+    
+    int tex_x = (int)((u - floor(u)) * texture->width()) % texture->width();
+    int tex_y = (int)((v - floor(v)) * texture->height()) % texture->height();
+    float darkness = fmax(0.0, 1.0 - (dist / 10));
+    
+    Gosu::Color pixel = texture->getPixel(tex_x, tex_y);
+    pixel.setRed(pixel.red() * darkness);
+    pixel.setGreen(pixel.green() * darkness);
+    pixel.setBlue(pixel.blue() * darkness);
+    return pixel;
+}
+
+// Floor or ceiling of one cell, between the distances at which the ray entered and left it. At reduced quality
+// each background row stands in for several screen rows, so only one of them is sampled.
+static void drawFlat(const ColumnView& view, const Gosu::Bitmap * texture, const double height, const double near_dist, const double far_dist, const int clip_top, const int clip_bottom) {
+    if(height == _camera_height) {
+        return;
+    }
+    
+    // A floor runs from the far edge down the screen to the near edge, a ceiling the other way round
+    bool is_floor = height < _camera_height;
+    int first = std::max(clip_top, clampRow(view, rowAt(view, height, is_floor ? far_dist : near_dist)));
+    int last = std::min(clip_bottom, clampRow(view, rowAt(view, height, is_floor ? near_dist : far_dist)));
+    
+    for(int row = firstBackgroundRow(first); first < last && row < endBackgroundRow(last); row++) {
+        int y = sampleRow(row, first, last);
+        double row_offset = y - view.horizon;
+        if(row_offset == 0) {
+            continue;
+        }
+        double dist = (_camera_height - height) * view.screen_h / row_offset;
+        putPixel(view, row, shadeTexel(texture, _pos_x + view.ray_dir_x * dist, _pos_y + view.ray_dir_y * dist, dist));
+        _stats.floor_pixels++;
+    }
+}
+
+// Vertical face where the floor steps up or the ceiling steps down between two open cells. These are
+// textured from the flat they belong to, since open cells have no wall texture of their own.
+static void drawStep(const ColumnView& view, const Gosu::Bitmap * texture, const double low, const double high, const double dist, const double along, const int clip_top, const int clip_bottom) {
+    int first = std::max(clip_top, clampRow(view, rowAt(view, high, dist)));
+    int last = std::min(clip_bottom, clampRow(view, rowAt(view, low, dist)));
+    
+    for(int row = firstBackgroundRow(first); first < last && row < endBackgroundRow(last); row++) {
+        double height = _camera_height - (sampleRow(row, first, last) - view.horizon) * dist / view.screen_h;
+        putPixel(view, row, shadeTexel(texture, along, high - height, dist));
+        _stats.floor_pixels++;
+    }
+}
+
+// Draw the visible rows of a wall face covering 'bottom' to 'top'. The texture column is stretched over
+// the whole face, but only the part inside the clip span is drawn.
+static void drawWallSpan(const ColumnView& view, Gosu::Image * wall, const int tex_x, const double bottom, const double top, const double dist, const int clip_top, const int clip_bottom) {
+    double face_top = rowAt(view, top, dist);
+    double face_bottom = rowAt(view, bottom, dist);
+    int first = std::max(clip_top, clampRow(view, face_top));
+    int last = std::min(clip_bottom, clampRow(view, face_bottom));
+    if(first >= last) {
+        return;
+    }
+    
+    // Only the rows of the texture that are in view
+    double tex_h = wall->height() - 2;
+    int tex_y1 = 1 + (int)(tex_h * (first - face_top) / (face_bottom - face_top));
+    int tex_y2 = 1 + (int)ceil(tex_h * (last - face_top) / (face_bottom - face_top));
+    tex_y1 = Gosu::clamp<int>(tex_y1, 1, tex_h);
+    tex_y2 = Gosu::clamp<int>(tex_y2, tex_y1 + 1, tex_h + 1);
+    
+    // Add color to simulate depth
+    int color_scaled = (255 * (1.0 / dist));
+    if(color_scaled > 255) {
+        color_scaled = 255;
+    }
+    Gosu::Color wall_color(255,color_scaled,color_scaled,color_scaled);
+    
+    _stats.wall_columns++;
+    _stats.subimage_allocations++;
+    hashValue(view.x);
+    hashValue(first);
+    hashValue(last);
+    hashValue(tex_x);
+    hashValue(tex_y1);
+    hashValue(tex_y2);
+    hashValue(wall_color.argb());
+    wall->getData().subimage(tex_x, tex_y1, 0, tex_y2 - tex_y1)->draw(
+       view.x - 1, first, wall_color,
+       view.x - 1 + view.width, first, wall_color,
+       view.x - 1 + view.width, last, wall_color,
+       view.x - 1, last, wall_color,
+       view.z - (dist * 0.05), Gosu::AlphaMode::amDefault
+    );
+}
+
+// The slice of a wall texture that a ray hitting 'side' at 'wall_x' (0.0-1.0 along the wall) should use
+static int wallTextureColumn(const Gosu::Image * wall, const int side, const double wall_x, const double ray_dir_x, const double ray_dir_y) {
+    int texX = (int)(wall->width() * wall_x);
+    if(side == 0 && ray_dir_x > 0) texX = wall->width() - texX - 1;
+    if(side == 1 && ray_dir_y < 0) texX = wall->height() - texX - 1;
+    
+    // Prevent out of bounds lines from trying to draw
+    if(texX == 0) {
+        texX++;
+    } else if(texX == wall->width() - 1) {
+        texX--;
+    }
+    return texX;
+}
+
+// ----
+
 void Gosu::RayCaster::draw(Window * win, const std::function <MapData(int, int)>& query, const std::vector<Sprite>& sprites) {
     if(_ready) {
         float z = -100;
         
+        Clock::time_point frame_start = Clock::now();
+        Clock::time_point pass_start = frame_start;
+        _stats = FrameStats();
+        _frame_hash = 14695981039346656037ULL;
+        _occlusions.clear();
+        
+        // Animations all run off the same clock for the whole frame
+        _frame_number++;
+        _stats.frame = _frame_number;
+        _frame_seconds = _fixed_frame_seconds >= 0 ? _fixed_frame_seconds : Gosu::milliseconds() / 1000.0;
+        
+        // Stripes may have been cut from textures the registry has since unloaded, and a new image could reuse
+        // the address they are keyed on
+        if(_textures && _textures->getGeneration() != _texture_generation) {
+            _texture_generation = _textures->getGeneration();
+            _stripe_cache.clear();
+        }
+        
+        // Let the governor pick this frame's quality from how long the last few took
+        governFrameTime(frame_start);
+        
         // This is the data gathered during passes, to prevent unneccessary re-calculations
         struct PassData {
             double camera_x;
@@ -183,24 +724,31 @@ void Gosu::RayCaster::draw(Window * win, const std::function <MapData(int, int)>
             double ray_dir_y;
             double delta_x;
             double delta_y;
-            double wall_distance;
+            double wall_distance;   // Where the column was completely covered; sprites and wall sprites behind it are hidden
+            size_t first_occlusion; // This column's run of _occlusions, for sprites partly hidden in front of that
+            size_t occlusions;
         };
         
-        // Prepare the ceiling/floor background image
+        // Prepare the ceiling/floor background image. At reduced quality it is smaller than the screen, which saves
+        // filling and uploading it, and is stretched to fit.
         unsigned screen_w = win->graphics().width();
         unsigned screen_h = win->graphics().height();
-        _ceiling_floor.resize(screen_w, screen_h);
+        _ceiling_floor.resize((screen_w + _quality.column_step - 1) / _quality.column_step,
+                              (screen_h + _quality.flat_row_step - 1) / _quality.flat_row_step);
         
         // Make sure the combined tilt and bob don't exceed draw area
         double camera_pitch_clamped = Gosu::clamp<double>(_camera_pitch + _camera_bob_current, -0.5, 0.5);
         int camera_pitch = screen_h * camera_pitch_clamped;
+        double horizon = (screen_h / 2.0) + camera_pitch;
         
         // We need data for every x value across the resolution
         PassData pass_data[screen_w];
         
-        // Begin the passes - each vertical slice of the screen is handled. Ergo, resolution = computation required
+        // Begin the passes - each vertical slice of the screen is handled. Ergo, resolution = computation required.
+        // At reduced quality a single ray stands in for several neighbouring columns.
+        int column_step = _quality.column_step;
         for(int pass = FIRST_PASS; pass < N_PASSES; pass++) {
-            for(int x = 0; x < screen_w; x++) {
+            for(int x = 0; x < screen_w; x += column_step) {
                 // Very first pass collects the pass information so nobody else has to worry about it
                 if(pass == FIRST_PASS) {
                     PassData pd;
@@ -209,6 +757,9 @@ void Gosu::RayCaster::draw(Window * win, const std::function <MapData(int, int)>
                     pd.ray_dir_y = _dir_y + _plane_y * pd.camera_x;
                     pd.delta_x = sqrt(1 + (pd.ray_dir_y * pd.ray_dir_y) / (pd.ray_dir_x * pd.ray_dir_x));
                     pd.delta_y = sqrt(1 + (pd.ray_dir_x * pd.ray_dir_x) / (pd.ray_dir_y * pd.ray_dir_y));
+                    pd.wall_distance = INFINITY;
+                    pd.first_occlusion = 0;
+                    pd.occlusions = 0;
                     pass_data[x] = pd;
                 }
                 
@@ -233,11 +784,141 @@ void Gosu::RayCaster::draw(Window * win, const std::function <MapData(int, int)>
                     side_dist_y = (cur_y + 1.0 - _pos_y) * pass_data[x].delta_y;
                 }
                 
-                // Execute raycast
+                ColumnView view = { x, std::min<int>(column_step, screen_w - x), screen_h, horizon, pass_data[x].ray_dir_x, pass_data[x].ray_dir_y, z };
+                
+                if(pass == WALL_PASS) {
+                    // Walls, floors and ceilings all come out of one walk along the ray. The clip span is the part of
+                    // this column nothing has covered yet; everything drawn narrows it, so a taller wall behind a short
+                    // one only fills what is left over it, and no row is drawn twice. The walk ends once it closes.
+                    int clip_top = 0;
+                    int clip_bottom = screen_h;
+                    size_t first_occlusion = _occlusions.size();
+                    
+                    // The cell being crossed, starting with the one the camera stands in
+                    MapData cell = query(cur_x, cur_y);
+                    _stats.map_queries++;
+                    resolveTextures(cell);
+                    double cell_floor = cell.floor_height;
+                    double cell_ceiling = cell.ceiling_height;
+                    double entry_dist = 0;
+                    
+                    int side = 0;
+                    while(clip_top < clip_bottom) {
+                        // Advance the ray
+                        if(side_dist_x < side_dist_y) {
+                            side_dist_x += pass_data[x].delta_x;
+                            cur_x += step_x;
+                            side = 0;
+                        } else {
+                            side_dist_y += pass_data[x].delta_y;
+                            cur_y += step_y;
+                            side = 1;
+                        }
+                        _stats.dda_steps++;
+                        
+                        // Distance to the edge just crossed, and how far along that edge it was crossed
+                        double dist, wall_x;
+                        if(side == 0) {
+                            dist = (cur_x - _pos_x + (1 - step_x) / 2) / pass_data[x].ray_dir_x;
+                            wall_x = _pos_y + dist * pass_data[x].ray_dir_y;
+                        } else {
+                            dist = (cur_y - _pos_y + (1 - step_y) / 2) / pass_data[x].ray_dir_y;
+                            wall_x = _pos_x + dist * pass_data[x].ray_dir_x;
+                        }
+                        wall_x -= floor(wall_x);
+                        
+                        // Past the quality setting's ray distance, the cell just left is drawn up to it and no further
+                        bool too_far = _quality.max_distance > 0 && dist > _quality.max_distance;
+                        if(too_far) {
+                            dist = _quality.max_distance;
+                        }
+                        
+                        // Floor and ceiling of the cell just left. Nothing further away can show below its floor's
+                        // far edge or above its ceiling's.
+                        drawFlat(view, cell.floor, cell_floor, entry_dist, dist, clip_top, clip_bottom);
+                        drawFlat(view, cell.ceiling, cell_ceiling, entry_dist, dist, clip_top, clip_bottom);
+                        clip_bottom = std::min(clip_bottom, clampRow(view, rowAt(view, cell_floor, dist)));
+                        clip_top = std::max(clip_top, clampRow(view, rowAt(view, cell_ceiling, dist)));
+                        entry_dist = dist;
+                        if(clip_top >= clip_bottom) {
+                            break;
+                        }
+                        recordOcclusion(first_occlusion, dist, clip_top, clip_bottom);
+                        
+                        // Sprites and wall sprites out there are hidden along with everything else
+                        if(too_far) {
+                            pass_data[x].wall_distance = dist;
+                            break;
+                        }
+                        
+                        // See what we got
+                        MapData response = query(cur_x, cur_y);
+                        _stats.map_queries++;
+                        resolveTextures(response);
+                        if(response.invalid) {
+                            break;
+                        }
+                        
+                        // Hidden sides and wall sprites are walked straight through, like open cells
+                        bool solid = response.wall && !response.wall_sprite && !(side == 0 && response.x_hidden) && !(side == 1 && response.y_hidden);
+                        if(solid) {
+                            int texX = wallTextureColumn(response.wall, side, wall_x, pass_data[x].ray_dir_x, pass_data[x].ray_dir_y);
+                            
+                            // The wall rises from the ground to wall_height. Its texture spans one unit down from the top,
+                            // or down to the floor in front if that is lower.
+                            double top = response.wall_height;
+                            drawWallSpan(view, response.wall, texX, fmin(cell_floor, top - 1), top, dist, clip_top, clip_bottom);
+                            clip_bottom = std::min(clip_bottom, clampRow(view, rowAt(view, top, dist)));
+                            
+                            // Everything above ceiling_height is solid as well, which leaves a window between the two
+                            double lintel = response.ceiling_height;
+                            drawWallSpan(view, response.wall, texX, lintel, fmax(cell_ceiling, lintel + 1), dist, clip_top, clip_bottom);
+                            clip_top = std::max(clip_top, clampRow(view, rowAt(view, lintel, dist)));
+                            
+                            // Looking through, the top of the wall is a floor and the underside of the lintel a ceiling
+                            cell_floor = top;
+                            cell_ceiling = lintel;
+                        } else {
+                            if(response.floor_height > cell_floor) {
+                                drawStep(view, response.floor, cell_floor, response.floor_height, dist, wall_x, clip_top, clip_bottom);
+                                clip_bottom = std::min(clip_bottom, clampRow(view, rowAt(view, response.floor_height, dist)));
+                            }
+                            if(response.ceiling_height < cell_ceiling) {
+                                drawStep(view, response.ceiling, response.ceiling_height, cell_ceiling, dist, wall_x, clip_top, clip_bottom);
+                                clip_top = std::max(clip_top, clampRow(view, rowAt(view, response.ceiling_height, dist)));
+                            }
+                            
+                            cell_floor = response.floor_height;
+                            cell_ceiling = response.ceiling_height;
+                        }
+                        cell = response;
+                        if(clip_top < clip_bottom) {
+                            recordOcclusion(first_occlusion, dist, clip_top, clip_bottom);
+                        }
+                    }
+                    
+                    if(clip_top >= clip_bottom) {
+                        pass_data[x].wall_distance = entry_dist;
+                    }
+                    pass_data[x].first_occlusion = first_occlusion;
+                    pass_data[x].occlusions = _occlusions.size() - first_occlusion;
+                    
+                    // Rows the walk never reached show nothing, rather than whatever was left there last frame. A
+                    // background row shared with something drawn is left to that.
+                    for(int row = endBackgroundRow(clip_top); (row + 1) * (int)_quality.flat_row_step <= clip_bottom; row++) {
+                        putPixel(view, row, Gosu::Color::NONE);
+                    }
+                    
+                    // Columns this ray stood in for share its data, so sprites are hidden the same way across them
+                    for(int i = 1; i < view.width; i++) {
+                        pass_data[x + i] = pass_data[x];
+                    }
+                    continue;
+                }
+                
+                // Execute raycast - the wall sprite pass, which sees through everything but full walls
                 int side = 0;
                 bool casting = true;
-                bool last_cast = false;
-                int skip_cast = 0;
                 while(casting) {
                     // Advance the ray
                     if(side_dist_x < side_dist_y) {
@@ -249,194 +930,101 @@ void Gosu::RayCaster::draw(Window * win, const std::function <MapData(int, int)>
                         cur_y += step_y;
                         side = 1;
                     }
+                    _stats.dda_steps++;
                     
-                    if(skip_cast > 0) {
-                        skip_cast --;
-                        continue;
+                    // Nothing is visible past the point where the wall pass covered this column
+                    double edge_dist = side == 0 ? (cur_x - _pos_x + (1 - step_x) / 2) / pass_data[x].ray_dir_x
+                                                 : (cur_y - _pos_y + (1 - step_y) / 2) / pass_data[x].ray_dir_y;
+                    if(edge_dist > pass_data[x].wall_distance) {
+                        break;
                     }
+                    
                     // See what we got
                     MapData response = query(cur_x, cur_y);
+                    _stats.map_queries++;
+                    if(response.wall_sprite) {
+                        resolveTextures(response);
+                    }
+                    
                     if(response.invalid) {
                         casting = false;
                     }
-                    // Don't draw hidden 'sides' or spaces with no wall... don't worry, floors are handled by the distant walls once they're reached.
-                    else if(response.wall && !(side == 0 && response.x_hidden) && !(side == 1 && response.y_hidden) ){
-                        // One last thing to check... make sure we're on the right pass for this wall! Was it a wall sprite?
-                        bool correct_pass = true;
-                        if(pass == WALL_PASS && response.wall_sprite) {
-                            correct_pass = false;
-                        } else if(pass == WALL_SPRITE_PASS && response.wall_sprite == false) {
-                            correct_pass = false;
+                    // Only wall sprites are drawn on this pass, and never their hidden 'sides'
+                    else if(response.wall && response.wall_sprite && !(side == 0 && response.x_hidden) && !(side == 1 && response.y_hidden) ){
+                        // Sprites allow an inset to be applied.
+                        double y_inset = 0;
+                        double x_inset = 0;
+                        if(side == 1) {
+                            y_inset = response.inset_amount * (pass_data[x].ray_dir_y > 0 ? 1:-1);
+                        } else {
+                            x_inset = response.inset_amount * (pass_data[x].ray_dir_x > 0 ? 1:-1);
                         }
                         
-                        if(correct_pass) {
-                            // Wall pass cancels raycasting, while sprites allow an inset to be applied.
-                            double y_inset = 0;
-                            double x_inset = 0;
-                            if(pass == WALL_PASS) {
-                                casting = false;
-                            } else if(pass == WALL_SPRITE_PASS) {
-                                if(side == 1) {
-                                    y_inset = response.inset_amount * (pass_data[x].ray_dir_y > 0 ? 1:-1);
-                                } else {
-                                    x_inset = response.inset_amount * (pass_data[x].ray_dir_x > 0 ? 1:-1);
-                                }
-                            }
-                            
-                            // Get the distance and the height of the wall slice from that. Inset is factored, so really the inset
-                            // block ISNT inset, it's just an illusion caused by adding extra distance. But it works!
-                            double wall_dist;
-                            if(side == 0) {
-                                wall_dist = ((cur_x + x_inset) - _pos_x + (1 - step_x) / 2) / pass_data[x].ray_dir_x;
+                        // Get the distance and the height of the wall slice from that. Inset is factored, so really the inset
+                        // block ISNT inset, it's just an illusion caused by adding extra distance. But it works!
+                        double wall_dist;
+                        if(side == 0) {
+                            wall_dist = ((cur_x + x_inset) - _pos_x + (1 - step_x) / 2) / pass_data[x].ray_dir_x;
+                        } else {
+                            wall_dist = ((cur_y + y_inset) - _pos_y + (1 - step_y) / 2) / pass_data[x].ray_dir_y;
+                        }
+                        double line_height = wall_dist == 0 ? 0 : screen_h / wall_dist;
+                        
+                        // Walls can still cover up wall sprites inset behind them
+                        if(wall_dist <= pass_data[x].wall_distance && line_height > 1) {
+                            // Determine the x of the wall that was hit
+                            double wall_x;
+                            if (side == 0) {
+                                wall_x = _pos_y + wall_dist * pass_data[x].ray_dir_y;
                             } else {
-                                wall_dist = ((cur_y + y_inset) - _pos_y + (1 - step_y) / 2) / pass_data[x].ray_dir_y;
+                                wall_x = _pos_x + wall_dist * pass_data[x].ray_dir_x;
                             }
-                            double line_height = wall_dist == 0 ? 0 : screen_h / wall_dist;
+                            wall_x -= floor(wall_x);
                             
-                            // Only solid walls get copied to the distance buffer
-                            if(pass == WALL_PASS) {
-                                pass_data[x].wall_distance = wall_dist;
-                            }
+                            // Wall sprites can have a texture offset to simulate sliding left and right
+                            wall_x -= response.texture_offset;
                             
-                            // This will always pass for walls, but not always for wall sprites. This way walls can cover up wall sprites.
-                            if(wall_dist <= pass_data[x].wall_distance && line_height > 1) {
-                                // Determine the x of the wall that was hit
-                                double wall_x;
-                                if (side == 0) {
-                                    wall_x = _pos_y + wall_dist * pass_data[x].ray_dir_y;
-                                } else {
-                                    wall_x = _pos_x + wall_dist * pass_data[x].ray_dir_x;
-                                }
-                                wall_x -= floor(wall_x);
-                                
-                                // Wall sprites can have a texture offset to simulate sliding left and right
-                                if(pass == WALL_SPRITE_PASS) {
-                                    wall_x -= response.texture_offset;
-                                }
-                                
-                                // From wall_x, we can get the slice of the texture to render
-                                int texX = (int)(response.wall->width() * wall_x);
-                                if(side == 0 && pass_data[x].ray_dir_x > 0) texX = response.wall->width() - texX - 1;
-                                if(side == 1 && pass_data[x].ray_dir_y < 0) texX = response.wall->height() - texX - 1;
-                                
-                                // Prevent out of bounds lines from trying to draw
-                                if(texX == 0) {
-                                    texX++;
-                                } else if(texX == response.wall->width() - 1) {
-                                    texX--;
-                                }
-                                
-                                // Calculate the four points of the subimage quad to draw
-                                int _x1 = x - 1;
-                                int _y1 = ((screen_h / 2) - (line_height / 2)) + camera_pitch;
-                                int _x2 = x;
-                                int _y2 = ((screen_h / 2) + (line_height / 2)) + camera_pitch + 1;
-                                
-                                // Add color to simulate depth
-                                int color_scaled = (255 * (line_height / screen_h));
-                                if(color_scaled > 255) {
-                                    color_scaled = 255;
-                                }
-                                Gosu::Color wall_color(255,color_scaled,color_scaled,color_scaled);
-                                
-                                // Render the line
-                                response.wall->getData().subimage(texX, 1, 0, response.wall->height() - 2)->draw(
-                                   _x1, _y1, wall_color,
-                                   _x2, _y1, wall_color,
-                                   _x2, _y2, wall_color,
-                                   _x1, _y2, wall_color,
-                                  z - (wall_dist * 0.05), Gosu::AlphaMode::amDefault
-                                );
-                                
-                                // From the top and bottom of the line we just rendered, the ceiling and floor can be drawn.
-                                // This is a pixel-by-pixel operation and is the best spot for any new optimization.
-                                if(pass == WALL_PASS) {
-                                    double floorXWall, floorYWall;
-                                    if(side == 0 && pass_data[x].ray_dir_x > 0) {
-                                        floorXWall = cur_x;
-                                        floorYWall = cur_y + wall_x;
-                                    }
-                                    else if(side == 0 && pass_data[x].ray_dir_x < 0) {
-                                        floorXWall = cur_x + 1.0;
-                                        floorYWall = cur_y + wall_x;
-                                    }
-                                    else if(side == 1 && pass_data[x].ray_dir_y > 0) {
-                                        floorXWall = cur_x + wall_x;
-                                        floorYWall = cur_y;
-                                    }
-                                    else {
-                                        floorXWall = cur_x + wall_x;
-                                        floorYWall = cur_y + 1.0;
-                                    }
-                                    
-                                    for(int y = _y2 - camera_pitch - 2; y < screen_h + abs(camera_pitch) + 2; y++) {
-                                        float current_dist = screen_h / (2.0 * y - screen_h);
-                                        double weight = current_dist / wall_dist;
-                                        
-                                        // Find the square on the ground
-                                        double cur_floor_x = weight * floorXWall + (1.0 - weight) * _pos_x;
-                                        double cur_floor_y = weight * floorYWall + (1.0 - weight) * _pos_y;
-                                        
-                                        // Once again, ask what floor is at that point if any
-                                        MapData response = query(cur_floor_x, cur_floor_y);
-                                        
-                                        // And how much darkness to apply
-                                        float darkness = fmax(0.0, 1.0 - (current_dist / 10));
-                                        
-                                        // Floor
-                                        if(response.floor) {
-                                            // Get the proper texture position
-                                            int floorTexX = int(cur_floor_x * response.floor->width()) % response.floor->width();
-                                            int floorTexY = int(cur_floor_y * response.floor->height()) % response.floor->height();
-                                            
-                                            Gosu::Color pixel = response.floor->getPixel(floorTexX, floorTexY);
-                                            pixel.setRed(pixel.red() * darkness);
-                                            pixel.setGreen(pixel.green() * darkness);
-                                            pixel.setBlue(pixel.blue() * darkness);
-                                            
-                                            float floor_y = (y + camera_pitch);
-                                            if(floor_y >= 0 && floor_y < screen_h) {
-                                                _ceiling_floor.setPixel(x,floor_y, pixel);
-                                            }
-                                        } else {
-                                            float floor_y = (y + camera_pitch);
-                                            if(floor_y >= 0 && floor_y < screen_h) {
-                                                _ceiling_floor.setPixel(x,floor_y, Gosu::Color::NONE);
-                                            }
-                                        }
-                                        
-                                        // Ceiling - only fully symmetric when player is not tilted
-                                        if(response.ceiling) {
-                                            int cielTexX = int(cur_floor_x * response.ceiling->width()) % response.ceiling->width();
-                                            int cielTexY = int(cur_floor_y * response.ceiling->height()) % response.ceiling->height();
-                                            
-                                            Gosu::Color pixel = response.ceiling->getPixel(cielTexX, cielTexY);
-                                            pixel.setRed(pixel.red() * darkness);
-                                            pixel.setGreen(pixel.green() * darkness);
-                                            pixel.setBlue(pixel.blue() * darkness);
-                                            
-                                            float ciel_y = ((screen_h + camera_pitch) - y);
-                                            if(ciel_y >= 0 && ciel_y < screen_h) {
-                                                _ceiling_floor.setPixel(x, ciel_y, pixel);
-                                            }
-                                        } else {
-                                            float ciel_y = ((screen_h + camera_pitch) - y);
-                                            if(ciel_y >= 0 && ciel_y < screen_h) {
-                                                _ceiling_floor.setPixel(x, ciel_y, Gosu::Color::NONE);
-                                            }
-                                        }
-                                    }
-                                }
-                            }
+                            // From wall_x, we can get the slice of the texture to render
+                            int texX = wallTextureColumn(response.wall, side, wall_x, pass_data[x].ray_dir_x, pass_data[x].ray_dir_y);
+                            
+                            // Wall sprites are always one unit tall. Short walls, steps and window frames in front
+                            // may leave only part of the slice showing, the same as for sprites.
+                            int clip_top = 0;
+                            int clip_bottom = screen_h;
+                            clipToOcclusions(pass_data[x].first_occlusion, pass_data[x].occlusions, wall_dist, clip_top, clip_bottom);
+                            drawWallSpan(view, response.wall, texX, 0.0, 1.0, wall_dist, clip_top, clip_bottom);
                         }
                     }
                 }
             }
+            
+            Clock::time_point pass_end = Clock::now();
+            if(pass == WALL_PASS) {
+                _stats.wall_pass_ns = nanosecondsBetween(pass_start, pass_end);
+                tracePhase("wall_pass", pass_start, _stats.wall_pass_ns);
+            } else {
+                _stats.wall_sprite_pass_ns = nanosecondsBetween(pass_start, pass_end);
+                tracePhase("wall_sprite_pass", pass_start, _stats.wall_sprite_pass_ns);
+            }
+            pass_start = pass_end;
         }
         
         // SPRITES - by now, our pass data will have included all wall distances. Don't draw slices
         // hidden by the wall distances, and put it at a z where wall sprites block them properly as well!
         for(auto sprite: sprites) {
+            // Work out the texture and which frame of it to draw. Plain textures are one big frame.
+            const SpriteSheet * sheet = sprite.sheet;
+            Gosu::Image * texture = sheet ? sheet->texture : sprite.texture;
+            bool placeholder = false;   // Loading or failed; the checkerboard has no frames to pick from
+            if(texture == NULL && _textures) {
+                Gosu::TextureHandle handle = sheet ? sheet->texture_handle : sprite.texture_handle;
+                texture = _textures->image(handle);
+                placeholder = !_textures->ready(handle);
+            }
+            if(texture == NULL) {
+                continue;
+            }
+            
             double sprite_x = (sprite.x + 0.5) - _pos_x;
             double sprite_y = (sprite.y + 0.5) - _pos_y;
             
@@ -445,11 +1033,36 @@ void Gosu::RayCaster::draw(Window * win, const std::function <MapData(int, int)>
             double transformX = invDet * (_dir_y * sprite_x - _dir_x * sprite_y);
             double transformZ = invDet * (-_plane_y * sprite_x + _plane_x * sprite_y);
             
+            // Behind the camera
+            if(transformZ <= 0) {
+                continue;
+            }
+            
+            int frame_x = 0;
+            int frame_y = 0;
+            int frame_w = texture->width();
+            int frame_h = texture->height();
+            if(sheet && !placeholder) {
+                int rows = sheet->directional ? 8 : 1;
+                frame_w = sheet->frame_width ? sheet->frame_width : texture->width();
+                frame_h = sheet->frame_height ? sheet->frame_height : std::max(1, (int)texture->height() / rows);
+                
+                int frames = std::max(1, (int)texture->width() / frame_w);
+                frame_x = (sprite.frame % frames) * frame_w;
+                
+                // Directional sheets show the view matching the angle from the sprite's facing round to the camera
+                if(sheet->directional) {
+                    double to_camera = atan2(-sprite_x, -sprite_y) * (180 / M_PI);
+                    double relative = fmod(to_camera - sprite.facing + 360.0 * 2 + 22.5, 360.0);
+                    frame_y = ((int)(relative / 45.0) % 8) * frame_h;
+                }
+            }
+            
             // Calculate our width and height
             int spriteScreenX = int((screen_w / 2) * (1 + transformX / transformZ));
             float spriteHeight = fabs(screen_w / (transformZ)) * 0.75;
-            float scale = spriteHeight / sprite.texture->height();
-            float spriteWidth = sprite.texture->width() * scale;
+            float scale = spriteHeight * sprite.scale / frame_h;
+            float spriteWidth = frame_w * scale;
             
             // Some color for distance
             int color_scaled = (255 * (spriteHeight / screen_h));
@@ -458,37 +1071,114 @@ void Gosu::RayCaster::draw(Window * win, const std::function <MapData(int, int)>
             }
             Gosu::Color color(255,color_scaled,color_scaled,color_scaled);
             
-            // Each stripe is drawn with the same height, in this case
-            int _y1 = (screen_h/2) - (spriteHeight / 2) + camera_pitch;
-            int _y2 = (screen_h/2) + (spriteHeight / 2) + camera_pitch;
+            // Each stripe is drawn with the same height, in this case. Sprites stand on the ground, so they sink
+            // as the camera rises, and scaling keeps their feet where they are.
+            double camera_lift = (_camera_height - 0.5) * screen_h / transformZ;
+            int _y2 = (screen_h/2) + (spriteHeight / 2) + camera_pitch + camera_lift - (sprite.z_offset * screen_h / transformZ);
+            int _y1 = _y2 - (spriteHeight * sprite.scale);
             
-            if(transformZ > 0) {
-                for(int stripe = 0; stripe < spriteWidth; stripe++) {
-                    // Draw it!
-                    int _x1 = (spriteScreenX  - (spriteWidth / 2)) + stripe;
-                    if(_x1 > 0 && _x1 < screen_w) {
-                        int _x2 = _x1 + 1;
-                        
-                        if(fabs(pass_data[_x1].wall_distance - transformZ) < 0.5 || (pass_data[_x1].wall_distance > transformZ)) {
-                            sprite.texture->getData().subimage(stripe / scale, 0, 1, sprite.texture->height())->draw(
-                                                                                                                     _x1, _y1, color,
-                                                                                                                     _x2, _y1, color,
-                                                                                                                     _x2, _y2, color,
-                                                                                                                     _x1, _y2, color,
-                                                                                                                     -transformZ, Gosu::AlphaMode::amDefault
-                                                                                                                     );
-                        }
+            // Only the stripes that land on screen are looked at
+            int left = spriteScreenX - (spriteWidth / 2);
+            int first = std::max(0, 1 - left);
+            int last = std::min((int)ceil(spriteWidth), (int)screen_w - left);
+            _stats.sprite_stripes_culled += std::max(0, (int)ceil(spriteWidth) - std::max(0, last - first));
+            
+            // At reduced quality only every few stripes are drawn, each widened over the ones skipped
+            int stripe_step = _quality.sprite_stripe_step;
+            for(int stripe = first; stripe < last; stripe += stripe_step) {
+                // Draw it!
+                int _x1 = left + stripe;
+                int _x2 = _x1 + std::min(stripe_step, last - stripe);
+                
+                // Short walls, steps and window frames in front may leave only part of the stripe showing
+                int top = _y1;
+                int bottom = _y2;
+                clipToOcclusions(pass_data[_x1].first_occlusion, pass_data[_x1].occlusions, transformZ, top, bottom);
+                
+                if((fabs(pass_data[_x1].wall_distance - transformZ) < 0.5 || (pass_data[_x1].wall_distance > transformZ)) && top < bottom) {
+                    _stats.sprite_stripes_drawn++;
+                    int column = std::min((int)texture->width() - 1, frame_x + std::min(frame_w - 1, (int)(stripe / scale)));
+                    
+                    // Only the rows of the frame that are in view, rounded out to whole bands. The rows shown are
+                    // squeezed a little into the space left rather than cutting a new stripe for every clip.
+                    int tex_top = 0;
+                    int tex_h = frame_h;
+                    bool clipped = top > _y1 || bottom < _y2;
+                    if(clipped) {
+                        int band = (frame_h + STRIPE_CLIP_BANDS - 1) / STRIPE_CLIP_BANDS;
+                        tex_top = Gosu::clamp<int>(frame_h * (double)(top - _y1) / (_y2 - _y1), 0, frame_h - 1) / band * band;
+                        int tex_bottom = (int)ceil(frame_h * (double)(bottom - _y1) / (_y2 - _y1) / band) * band;
+                        tex_h = Gosu::clamp<int>(tex_bottom, tex_top + 1, frame_h) - tex_top;
                     }
+                    
+                    // Sheets whose frame size doesn't divide the texture have a ragged last row; never read past it
+                    int row = std::min(frame_y + tex_top, (int)texture->height() - 1);
+                    tex_h = std::min(tex_h, (int)texture->height() - row);
+                    
+                    hashValue(_x1);
+                    hashValue(top);
+                    hashValue(bottom);
+                    hashValue(column);
+                    hashValue(row);
+                    spriteStripe(texture, column, row, tex_h, clipped)->draw(
+                        _x1, top, color,
+                        _x2, top, color,
+                        _x2, bottom, color,
+                        _x1, bottom, color,
+                        -transformZ, Gosu::AlphaMode::amDefault
+                    );
+                } else {
+                    _stats.sprite_stripes_culled++;
                 }
             }
         }
         
-        // Drop the frame rate on the ceiling texture if it was enabled
+        Clock::time_point sprites_end = Clock::now();
+        _stats.sprite_pass_ns = nanosecondsBetween(pass_start, sprites_end);
+        tracePhase("sprite_pass", pass_start, _stats.sprite_pass_ns);
+        
+        // Frame rate goes on top of everything. Text rendering is slow, so it only happens when the number changes.
         if(_fps_enabled) {
-            Gosu::drawText(_ceiling_floor, std::to_wstring(Gosu::fps()),0,0,Gosu::Color::WHITE, L"arial", 20);
+            if(Gosu::fps() != _fps_shown || !_fps_image) {
+                _fps_shown = Gosu::fps();
+                Gosu::Bitmap text(80, 24);
+                Gosu::drawText(text, std::to_wstring(_fps_shown),0,0,Gosu::Color::WHITE, L"arial", 20);
+                _fps_image.reset(new Gosu::Image(text));
+            }
+            _fps_image->draw(0, 0, 0);
         }
         
         // Draw ceiling and floor
-        Gosu::Image(_ceiling_floor).draw(0,0,z - 50);
+        Gosu::Image(_ceiling_floor).draw(0,0,z - 50, _quality.column_step, _quality.flat_row_step);
+        
+        Clock::time_point frame_end = Clock::now();
+        _stats.background_ns = nanosecondsBetween(sprites_end, frame_end);
+        _stats.total_ns = nanosecondsBetween(frame_start, frame_end);
+        tracePhase("background", sprites_end, _stats.background_ns);
+        
+        // Hashing every background pixel is slow, so it happens after the clock stops
+        if(_hashing) {
+            const Gosu::Color * pixels = _ceiling_floor.data();
+            for(unsigned i = 0; i < _ceiling_floor.width() * _ceiling_floor.height(); i++) {
+                hashValue(pixels[i].argb());
+            }
+            _stats.image_hash = _frame_hash;
+        }
+        
+        if(_trace.is_open()) {
+            tracePhase("frame", frame_start, _stats.total_ns);
+            traceEvent("{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"tid\":1,\"ts\":" +
+                       std::to_string(std::chrono::duration_cast<std::chrono::microseconds>(frame_start.time_since_epoch()).count()) +
+                       ",\"args\":{\"map_queries\":" + std::to_string(_stats.map_queries) +
+                       ",\"dda_steps\":" + std::to_string(_stats.dda_steps) +
+                       ",\"wall_columns\":" + std::to_string(_stats.wall_columns) +
+                       ",\"sprite_stripes_drawn\":" + std::to_string(_stats.sprite_stripes_drawn) +
+                       ",\"sprite_stripes_culled\":" + std::to_string(_stats.sprite_stripes_culled) +
+                       ",\"floor_pixels\":" + std::to_string(_stats.floor_pixels) +
+                       ",\"subimage_allocations\":" + std::to_string(_stats.subimage_allocations) +
+                       ",\"column_step\":" + std::to_string(_stats.quality.column_step) +
+                       ",\"flat_row_step\":" + std::to_string(_stats.quality.flat_row_step) +
+                       ",\"sprite_stripe_step\":" + std::to_string(_stats.quality.sprite_stripe_step) + "}}");
+        }
     }
 }
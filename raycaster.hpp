@@ -1,16 +1,43 @@
 /**
  *	Raycaster engine for the Gosu game library
  */
+#ifndef GOSU_RAYCAST_RAYCASTER_HPP
+#define GOSU_RAYCAST_RAYCASTER_HPP
+
 #include <Gosu/Gosu.hpp>
 
+#include "simulation.hpp"
+#include "textures.hpp"
+
 namespace Gosu {
     class RayCaster {
     public:
+        // A texture cut into a grid of equally sized frames. Columns are animation frames. A directional sheet has
+        // eight rows, one per view of the sprite: row 0 is seen from the front, and each row after it is 45 degrees
+        // further round, in the direction that angles increase (see Sprite::facing).
+        struct SpriteSheet {
+            Gosu::Image * texture = NULL;
+            TextureHandle texture_handle;   // Used instead of texture when that is NULL
+            unsigned frame_width = 0;       // 0 for the whole width of the texture
+            unsigned frame_height = 0;      // 0 for the whole height, or an eighth of it when directional
+            bool directional = false;
+        };
+        
         // Data provided to draw call, so that the sprites can display in the renderer
         struct Sprite {
             Gosu::Image * texture = NULL;
+            TextureHandle texture_handle;   // Used instead of texture when that is NULL. See setTextureRegistry.
             double x = 0;
             double y = 0;
+            
+            // Sheets are used instead of either texture when set
+            const SpriteSheet * sheet = NULL;
+            unsigned frame = 0;             // Column of the sheet, wrapped to the number of frames
+            double facing = 0;              // Degrees the sprite faces, as atan2(x, y) - so 0 faces +y
+            double scale = 1.0;             // Size relative to a normal sprite, still standing on the floor
+            double z_offset = 0.0;          // Lift off the floor, in world units
+            
+            unsigned tag = 0;               // Yours to use; recordings keep it so replays can put textures back
         };
         
         // Data supplied to the raycaster so it knows what it is looking at
@@ -22,6 +49,30 @@ namespace Gosu {
             Gosu::Bitmap * floor = NULL;
             Gosu::Bitmap * ceiling = NULL;
             
+            // Registry handles, used for any of the above that are left NULL. See setTextureRegistry.
+            TextureHandle wall_handle;
+            TextureHandle floor_handle;
+            TextureHandle ceiling_handle;
+            
+            // Animated and generated textures, used in place of the handles above when set. animation_phase is how far
+            // (0.0-1.0) into its cycle this cell's animation is, so neighbouring tiles don't all change in lockstep.
+            const AnimatedTexture * wall_animation = NULL;
+            const AnimatedTexture * floor_animation = NULL;
+            const AnimatedTexture * ceiling_animation = NULL;
+            float animation_phase = 0.0;
+            ProceduralTexture * wall_procedural = NULL;
+            ProceduralTexture * floor_procedural = NULL;
+            ProceduralTexture * ceiling_procedural = NULL;
+            
+            // Heights in world units, where the ground is 0.0 and a default wall is 1.0 tall. On an open cell these
+            // place the floor and ceiling; steps between neighbouring cells are textured from the floor or ceiling.
+            // On a wall cell the wall rises from the ground to wall_height and everything above ceiling_height is
+            // solid too, so a short wall is a ledge or platform you can see over and the gap between the two is a
+            // window. The top of a short wall draws with 'floor' and the underside of the lintel with 'ceiling'.
+            float floor_height = 0.0;
+            float ceiling_height = 1.0;
+            float wall_height = 1.0;
+            
             bool x_hidden = false;		// The x sides of the block are not drawn
             bool y_hidden = false;		// The y sides of the block are not drawn
             
@@ -32,11 +83,89 @@ namespace Gosu {
             float texture_offset = 0.0;	// Appears to shift this block to the left or right
         };
         
+        // How much work draw does per frame. Each knob trades a little picture quality for speed; the defaults
+        // draw everything at full quality.
+        struct QualitySettings {
+            unsigned column_step = 1;           // Cast one ray per this many screen columns and widen its slices to fill
+            unsigned flat_row_step = 1;         // Sample floors and ceilings every this many rows and stretch them to fill
+            double max_distance = 0;            // Rays stop this far out and leave the background showing; 0 is unlimited
+            unsigned sprite_stripe_step = 1;    // Draw every this many sprite stripes, each widened to fill the gap
+        };
+        
+        // Bits of FrameStats::quality_changes
+        enum QualityKnob {
+            QUALITY_RESOLUTION = 1,
+            QUALITY_FLAT_SAMPLING = 2,
+            QUALITY_RAY_DISTANCE = 4,
+            QUALITY_SPRITE_LOD = 8
+        };
+        
+        // What the most recent draw call did, for profiling. Times are in nanoseconds.
+        struct FrameStats {
+            unsigned long frame = 0;
+            
+            unsigned long map_queries = 0;          // Calls made to the MapData query
+            unsigned long dda_steps = 0;            // Cells stepped through, over all rays and passes
+            unsigned long wall_columns = 0;         // Wall and wall sprite slices drawn
+            unsigned long sprite_stripes_drawn = 0;
+            unsigned long sprite_stripes_culled = 0; // Off screen or behind a wall
+            unsigned long floor_pixels = 0;         // Floor, ceiling and step pixels written
+            unsigned long subimage_allocations = 0;
+            unsigned long stripe_cache_hits = 0;    // Sprite stripes that didn't need a subimage
+            unsigned long stripe_clip_misses = 0;   // Sprite stripes that did, and were cut short by something in front
+            
+            unsigned long long wall_pass_ns = 0;
+            unsigned long long wall_sprite_pass_ns = 0;
+            unsigned long long sprite_pass_ns = 0;
+            unsigned long long background_ns = 0;   // Turning the floor and ceiling into an image and drawing it
+            unsigned long long total_ns = 0;
+            
+            // Digest of what was drawn, for spotting rendering changes between runs. 0 unless enabled with
+            // setFrameHashing.
+            unsigned long long image_hash = 0;
+            
+            // The settings this frame was drawn with, and which knobs the frame time governor turned for it
+            QualitySettings quality;
+            unsigned quality_changes = 0;           // QualityKnob bits
+            double average_frame_ms = 0;            // Recent time between draw calls, as the governor sees it
+        };
+        
         RayCaster();
         
-        // Debugging assistant
+        // Debugging assistant. The rate is drawn on top of everything, and only re-rendered when it changes.
         void setDisplayFPS(const bool enable);
         
+        // Counters for the last frame drawn
+        const FrameStats& getFrameStats();
+        
+        // Append every frame's stats to a Chrome trace file (open with chrome://tracing or Perfetto), so that
+        // builds can be profiled without attaching a profiler. Any existing file is replaced. An empty filename
+        // finishes the current trace.
+        void setTraceFile(const std::string& filename);
+        
+        // Fill in FrameStats::image_hash from the floor and ceiling pixels and every slice drawn. The GPU's output
+        // can't be read back, so this hashes what the renderer was told to draw instead. Costs a little per slice.
+        void setFrameHashing(const bool enable);
+        
+        // Draw at fixed quality. Turns off the frame time governor.
+        void setQuality(const QualitySettings& quality);
+        const QualitySettings& getQuality();
+        
+        // Hold frames to this many milliseconds by lowering quality when recent frames run over and raising it again
+        // when there is room to spare. Frame time is measured from one draw call to the next, so with vsync on the
+        // governor can't see spare time below the refresh interval - set a budget at or above it. 0 turns it off and
+        // leaves quality where it is.
+        void setFrameTimeBudget(const double milliseconds);
+        
+        // Sprite stripes are cut from their textures once and reused between frames. Call this before destroying
+        // an image that sprites have been drawn with, so nothing is left pointing into it. Textures unloaded from
+        // the texture registry are taken care of automatically on the next draw.
+        void clearSpriteCache();
+        
+        // The registry that texture handles in MapData and Sprite are looked up in. Handles that are still
+        // loading draw as the registry's placeholder. The registry must outlive its use here.
+        void setTextureRegistry(TextureRegistry * registry);
+        
         // Place the camera at a specific position in the world
         void setCameraPosition(const double x, const double y);
         void setCameraPosition(const std::pair<double, double>& xy);
@@ -82,6 +211,26 @@ namespace Gosu {
         
         const double getCameraPitch();
         
+        // Eye level of the camera in world units, 0.5 by default (halfway up a wall). Raise it to stand on
+        // platforms or climb stairs built from MapData heights.
+        void setCameraHeight(const double height);
+        
+        const double getCameraHeight();
+        
+        // Take on everything about the camera at once, usually CameraSimulation::interpolated. Bobbing is
+        // applied as given rather than animated by bobCamera.
+        void setCameraState(const CameraState& state);
+        
+        const CameraState getCameraState();
+        
+        // The clock animations and procedural textures run on, in seconds. Each draw normally reads it from
+        // Gosu::milliseconds; setting it pins every draw after to that time, until it is set again or a negative
+        // value hands it back to the real clock. Replays use this to draw exactly what was recorded.
+        void setFrameTime(const double seconds);
+        
+        // The time the most recent draw ran its animations at
+        const double getFrameTime();
+        
         // This is the heavy lifter. Call from the draw method of a Gosu::Window to render your world.
         //
         // win - link back to your window
@@ -92,3 +241,5 @@ namespace Gosu {
         void draw(Window * win, const std::function <MapData(int, int)>& query, const std::vector<Sprite>& sprites);
     };
 };
+
+#endif
@@ -0,0 +1,219 @@
+#include "recorder.hpp"
+
+#include <string.h>
+
+// File layout, all little-endian:
+//   header: "GRCR", u16 version
+//   frame:  u8 flags, u32 map version, f64 frame time (from version 2),
+//           quality (from version 3: u32 column step, u32 flat row step, f64 max distance, u32 sprite stripe step),
+//           camera (7 x f64, i8 bob direction),
+//           then if FRAME_SPRITES is set, u32 count and per sprite:
+//           u32 tag, f64 x, f64 y, u32 frame, f32 facing, f32 scale, f32 z offset
+static const char MAGIC[4] = { 'G', 'R', 'C', 'R' };
+static const std::uint16_t VERSION = 3;
+static const std::uint16_t OLDEST_VERSION = 1;  // Oldest layout that can still be read
+
+enum FrameFlags {
+    FRAME_SPRITES = 1   // The sprite list changed and follows the camera
+};
+
+// --- Fixed-size little-endian reading and writing ---
+
+static void writeBytes(std::ofstream& file, std::uint64_t value, const int bytes) {
+    char buffer[8];
+    for(int i = 0; i < bytes; i++) {
+        buffer[i] = (value >> (i * 8)) & 0xff;
+    }
+    file.write(buffer, bytes);
+}
+
+static void writeDouble(std::ofstream& file, const double value) {
+    std::uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    writeBytes(file, bits, 8);
+}
+
+static void writeFloat(std::ofstream& file, const float value) {
+    std::uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    writeBytes(file, bits, 4);
+}
+
+static std::uint64_t readBytes(std::ifstream& file, const int bytes) {
+    unsigned char buffer[8] = { 0 };
+    file.read((char *)buffer, bytes);
+    
+    std::uint64_t value = 0;
+    for(int i = 0; i < bytes; i++) {
+        value |= (std::uint64_t)buffer[i] << (i * 8);
+    }
+    return value;
+}
+
+static double readDouble(std::ifstream& file) {
+    std::uint64_t bits = readBytes(file, 8);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static float readFloat(std::ifstream& file) {
+    std::uint32_t bits = readBytes(file, 4);
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Whether two sprites would be written out the same
+static bool sameRecordedSprite(const Gosu::RayCaster::Sprite& a, const Gosu::RayCaster::Sprite& b) {
+    return a.tag == b.tag && a.x == b.x && a.y == b.y && a.frame == b.frame &&
+           (float)a.facing == (float)b.facing && (float)a.scale == (float)b.scale && (float)a.z_offset == (float)b.z_offset;
+}
+
+// ----
+
+Gosu::FrameRecorder::FrameRecorder() {
+    _first = true;
+}
+
+Gosu::FrameRecorder::~FrameRecorder() {
+    close();
+}
+
+bool Gosu::FrameRecorder::open(const std::string& filename) {
+    close();
+    
+    _file.open(filename.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if(!_file.is_open()) {
+        return false;
+    }
+    
+    _file.write(MAGIC, sizeof(MAGIC));
+    writeBytes(_file, VERSION, 2);
+    _first = true;
+    _last_sprites.clear();
+    return _file.good();
+}
+
+void Gosu::FrameRecorder::close() {
+    if(_file.is_open()) {
+        _file.close();
+    }
+}
+
+bool Gosu::FrameRecorder::isOpen() const {
+    return _file.is_open();
+}
+
+void Gosu::FrameRecorder::record(const std::uint32_t map_version, const double frame_time, const RayCaster::QualitySettings& quality, const CameraState& camera, const std::vector<RayCaster::Sprite>& sprites) {
+    if(!_file.is_open()) {
+        return;
+    }
+    
+    // Most frames have the same sprites as the last one, so only write them when something moved
+    bool sprites_changed = _first || sprites.size() != _last_sprites.size();
+    for(size_t i = 0; !sprites_changed && i < sprites.size(); i++) {
+        sprites_changed = !sameRecordedSprite(sprites[i], _last_sprites[i]);
+    }
+    _first = false;
+    
+    writeBytes(_file, sprites_changed ? FRAME_SPRITES : 0, 1);
+    writeBytes(_file, map_version, 4);
+    writeDouble(_file, frame_time);
+    
+    writeBytes(_file, quality.column_step, 4);
+    writeBytes(_file, quality.flat_row_step, 4);
+    writeDouble(_file, quality.max_distance);
+    writeBytes(_file, quality.sprite_stripe_step, 4);
+    
+    writeDouble(_file, camera.x);
+    writeDouble(_file, camera.y);
+    writeDouble(_file, camera.dir_x);
+    writeDouble(_file, camera.dir_y);
+    writeDouble(_file, camera.pitch);
+    writeDouble(_file, camera.bob);
+    writeDouble(_file, camera.height);
+    writeBytes(_file, (std::uint8_t)(std::int8_t)camera.bob_direction, 1);
+    
+    if(sprites_changed) {
+        writeBytes(_file, sprites.size(), 4);
+        for(const RayCaster::Sprite& sprite: sprites) {
+            writeBytes(_file, sprite.tag, 4);
+            writeDouble(_file, sprite.x);
+            writeDouble(_file, sprite.y);
+            writeBytes(_file, sprite.frame, 4);
+            writeFloat(_file, sprite.facing);
+            writeFloat(_file, sprite.scale);
+            writeFloat(_file, sprite.z_offset);
+        }
+        _last_sprites = sprites;
+    }
+}
+
+bool Gosu::FrameReplay::open(const std::string& filename) {
+    _file.open(filename.c_str(), std::ios::in | std::ios::binary);
+    _sprites.clear();
+    _frames = 0;
+    
+    char magic[sizeof(MAGIC)];
+    _file.read(magic, sizeof(magic));
+    if(!_file.good() || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+        return false;
+    }
+    _version = readBytes(_file, 2);
+    return _version >= OLDEST_VERSION && _version <= VERSION && _file.good();
+}
+
+bool Gosu::FrameReplay::next(FrameRecord& record) {
+    std::uint8_t flags = readBytes(_file, 1);
+    if(!_file.good()) {
+        return false;
+    }
+    
+    record.map_version = readBytes(_file, 4);
+    record.frame_time = _version >= 2 ? readDouble(_file) : -1;
+    
+    record.quality = RayCaster::QualitySettings();
+    if(_version >= 3) {
+        record.quality.column_step = readBytes(_file, 4);
+        record.quality.flat_row_step = readBytes(_file, 4);
+        record.quality.max_distance = readDouble(_file);
+        record.quality.sprite_stripe_step = readBytes(_file, 4);
+    }
+    
+    record.camera.x = readDouble(_file);
+    record.camera.y = readDouble(_file);
+    record.camera.dir_x = readDouble(_file);
+    record.camera.dir_y = readDouble(_file);
+    record.camera.pitch = readDouble(_file);
+    record.camera.bob = readDouble(_file);
+    record.camera.height = readDouble(_file);
+    record.camera.bob_direction = (std::int8_t)readBytes(_file, 1);
+    
+    if(flags & FRAME_SPRITES) {
+        std::uint32_t count = readBytes(_file, 4);
+        _sprites.clear();
+        for(std::uint32_t i = 0; i < count && _file.good(); i++) {
+            RayCaster::Sprite sprite;
+            sprite.tag = readBytes(_file, 4);
+            sprite.x = readDouble(_file);
+            sprite.y = readDouble(_file);
+            sprite.frame = readBytes(_file, 4);
+            sprite.facing = readFloat(_file);
+            sprite.scale = readFloat(_file);
+            sprite.z_offset = readFloat(_file);
+            _sprites.push_back(sprite);
+        }
+    }
+    record.sprites = _sprites;
+    
+    if(!_file.good()) {
+        return false;
+    }
+    _frames++;
+    return true;
+}
+
+unsigned long Gosu::FrameReplay::getFrameCount() const {
+    return _frames;
+}
@@ -0,0 +1,78 @@
+/**
+ *	Recording and replaying what the raycaster was asked to draw, so that a session can be
+ *	re-rendered offline as a repeatable benchmark.
+ */
+#ifndef GOSU_RAYCAST_RECORDER_HPP
+#define GOSU_RAYCAST_RECORDER_HPP
+
+#include "raycaster.hpp"
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace Gosu {
+    // Everything needed to draw one frame again, apart from the map itself
+    struct FrameRecord {
+        // Bump this in your own code whenever the map changes, so a replay can tell which map a frame was drawn
+        // against. It is stored, not interpreted.
+        std::uint32_t map_version = 0;
+        
+        // RayCaster::getFrameTime when the frame was drawn, so animations replay as they were. Negative for
+        // recordings made before it was stored.
+        double frame_time = -1;
+        
+        // RayCaster::getQuality when the frame was drawn, so frames the governor cut back replay at the same cost.
+        // Full quality for recordings made before it was stored.
+        RayCaster::QualitySettings quality;
+        
+        CameraState camera;
+        
+        // Only the positional parts of each sprite and its tag survive the round trip. Textures and sheets
+        // are pointers and can't be saved, so put them back from the tag after reading.
+        std::vector<RayCaster::Sprite> sprites;
+    };
+    
+    // Writes frames to a compact binary file. Sprite lists are only written when they change.
+    class FrameRecorder {
+    public:
+        FrameRecorder();
+        ~FrameRecorder();
+        
+        // Start a new recording, replacing any file already there. Returns false if it can't be written.
+        bool open(const std::string& filename);
+        void close();
+        
+        bool isOpen() const;
+        
+        // Add one frame. Does nothing unless a recording is open.
+        void record(const std::uint32_t map_version, const double frame_time, const RayCaster::QualitySettings& quality, const CameraState& camera, const std::vector<RayCaster::Sprite>& sprites);
+        
+    private:
+        std::ofstream _file;
+        std::vector<RayCaster::Sprite> _last_sprites;
+        bool _first;
+    };
+    
+    // Reads back what a FrameRecorder wrote, one frame at a time
+    class FrameReplay {
+    public:
+        // Returns false if the file is missing or isn't a recording
+        bool open(const std::string& filename);
+        
+        // Fill in the next frame. Returns false at the end of the recording, or if it is cut short.
+        bool next(FrameRecord& record);
+        
+        // Frames read so far
+        unsigned long getFrameCount() const;
+        
+    private:
+        std::ifstream _file;
+        std::vector<RayCaster::Sprite> _sprites;
+        unsigned long _frames = 0;
+        std::uint16_t _version = 0;
+    };
+};
+
+#endif
@@ -0,0 +1,239 @@
+#include "simulation.hpp"
+
+#include <math.h>
+#include <algorithm>
+
+// Longest stretch of time one call to advance will simulate, so a stall doesn't turn into a spiral of catch-up
+static const double MAX_ADVANCE = 0.25;
+
+// How far short of a solid cell's edge a sweep stops, so the camera never ends up exactly on it
+static const double EDGE_EPSILON = 0.000001;
+
+Gosu::CameraSimulation::CameraSimulation(const double ticks_per_second) {
+    _tick_length = 1.0 / ticks_per_second;
+    _accumulated = 0;
+    _ticks = 0;
+
+    // Defaults match the demo's controls
+    _walk_speed = 2.0;
+    _turn_speed = 80.0;
+    _pitch_speed = 1.0;
+    _bob_speed = 0.3;
+    _bob_range = 0.03;
+    _wall_margin = 0.1;
+}
+
+void Gosu::CameraSimulation::setState(const CameraState& state) {
+    _current = state;
+    _previous = state;
+    _accumulated = 0;
+}
+
+const Gosu::CameraState& Gosu::CameraSimulation::getState() const {
+    return _current;
+}
+
+void Gosu::CameraSimulation::setWalkSpeed(const double units) {
+    _walk_speed = units;
+}
+
+void Gosu::CameraSimulation::setTurnSpeed(const double degrees) {
+    _turn_speed = degrees;
+}
+
+void Gosu::CameraSimulation::setPitchSpeed(const double amount) {
+    _pitch_speed = amount;
+}
+
+void Gosu::CameraSimulation::setBobSpeed(const double amount) {
+    _bob_speed = amount;
+}
+
+void Gosu::CameraSimulation::setBobRange(const double amount) {
+    _bob_range = std::min(0.5, std::max(-0.5, amount));
+}
+
+void Gosu::CameraSimulation::setWallMargin(const double units) {
+    _wall_margin = units;
+}
+
+void Gosu::CameraSimulation::setInput(const CameraInput& input) {
+    _input = input;
+}
+
+unsigned Gosu::CameraSimulation::advance(const double seconds, const SolidQuery& solid) {
+    _accumulated += std::min(seconds, MAX_ADVANCE);
+
+    unsigned ran = 0;
+    while(_accumulated >= _tick_length) {
+        tick(solid);
+        _accumulated -= _tick_length;
+        ran++;
+    }
+    return ran;
+}
+
+void Gosu::CameraSimulation::tick(const SolidQuery& solid) {
+    _previous = _current;
+    _ticks++;
+    double dt = _tick_length;
+
+    // Turn - the same rotation as RayCaster::rotateCamera
+    if(_input.turn != 0) {
+        double amount = _input.turn * _turn_speed * dt * (M_PI / 180);
+        double old = _current.dir_x;
+        _current.dir_x = _current.dir_x * cos(amount) - _current.dir_y * sin(amount);
+        _current.dir_y = old * sin(amount) + _current.dir_y * cos(amount);
+    }
+
+    // Tilt
+    _current.pitch = std::min(0.5, std::max(-0.5, _current.pitch + _input.pitch * _pitch_speed * dt));
+
+    // Walk and strafe. Strafing is along the camera plane, as in RayCaster::transformCamera.
+    double forward = _input.forward * _walk_speed * dt;
+    double strafe = _input.strafe * _walk_speed * dt;
+    double plane_x = _current.dir_y * -0.66;
+    double plane_y = _current.dir_x * 0.66;
+    double dx = _current.dir_x * forward + plane_x * strafe;
+    double dy = _current.dir_y * forward + plane_y * strafe;
+    if(dx != 0 || dy != 0) {
+        _sweep(dx, dy, solid);
+    }
+
+    // Bob while walking forward, easing back to rest otherwise - as in RayCaster::bobCamera
+    double range = _input.forward > 0 ? _bob_range : 0;
+    if(range != 0 || _current.bob != 0) {
+        _current.bob += _bob_speed * dt * _current.bob_direction;
+
+        if(_current.bob_direction == 1 && _current.bob > range) {
+            _current.bob_direction = -1;
+            if(_current.bob - range < 0.1) {
+                _current.bob = range;
+            }
+        } else if(_current.bob_direction == -1 && _current.bob < -range) {
+            _current.bob_direction = 1;
+            if(range - _current.bob < 0.1) {
+                _current.bob = -range;
+            }
+        }
+    }
+}
+
+Gosu::CameraState Gosu::CameraSimulation::interpolated() const {
+    double alpha = _accumulated / _tick_length;
+    CameraState state = _current;
+
+    state.x = _previous.x + (_current.x - _previous.x) * alpha;
+    state.y = _previous.y + (_current.y - _previous.y) * alpha;
+    state.pitch = _previous.pitch + (_current.pitch - _previous.pitch) * alpha;
+    state.bob = _previous.bob + (_current.bob - _previous.bob) * alpha;
+    state.height = _previous.height + (_current.height - _previous.height) * alpha;
+
+    // Blend the facing, then put it back to the length it had
+    double dir_x = _previous.dir_x + (_current.dir_x - _previous.dir_x) * alpha;
+    double dir_y = _previous.dir_y + (_current.dir_y - _previous.dir_y) * alpha;
+    double length = sqrt(dir_x * dir_x + dir_y * dir_y);
+    if(length > 0) {
+        double wanted = sqrt(_current.dir_x * _current.dir_x + _current.dir_y * _current.dir_y);
+        state.dir_x = dir_x * wanted / length;
+        state.dir_y = dir_y * wanted / length;
+    }
+    return state;
+}
+
+unsigned long Gosu::CameraSimulation::getTickCount() const {
+    return _ticks;
+}
+
+double Gosu::CameraSimulation::getTickLength() const {
+    return _tick_length;
+}
+
+void Gosu::CameraSimulation::_sweep(double dx, double dy, const SolidQuery& solid) {
+    double x = _current.x;
+    double y = _current.y;
+    int start_x = floor(x);
+    int start_y = floor(y);
+    bool toward_left = dx < 0, toward_right = dx > 0;
+    bool toward_top = dy < 0, toward_bottom = dy > 0;
+
+    // Walk the cells the move passes through, the same way the renderer walks a ray. Hitting a solid cell stops
+    // that axis at its edge and the rest of the move slides along it, so no move is ever fast enough to tunnel.
+    for(int slide = 0; slide < 2 && (dx != 0 || dy != 0); slide++) {
+        int cell_x = floor(x);
+        int cell_y = floor(y);
+        int step_x = dx < 0 ? -1 : 1;
+        int step_y = dy < 0 ? -1 : 1;
+
+        // Fraction of the move at which the next x and y edges are crossed, and how much further each one after
+        double next_x = dx != 0 ? (dx > 0 ? cell_x + 1 - x : x - cell_x) / fabs(dx) : INFINITY;
+        double next_y = dy != 0 ? (dy > 0 ? cell_y + 1 - y : y - cell_y) / fabs(dy) : INFINITY;
+        double each_x = dx != 0 ? 1.0 / fabs(dx) : INFINITY;
+        double each_y = dy != 0 ? 1.0 / fabs(dy) : INFINITY;
+
+        int side = -1;
+        double hit = 1.0;
+        while(side < 0) {
+            if(next_x < next_y) {
+                if(next_x > 1) {
+                    break;
+                }
+                cell_x += step_x;
+                hit = next_x;
+                next_x += each_x;
+                if(solid(cell_x, cell_y)) {
+                    side = 0;
+                }
+            } else {
+                if(next_y > 1) {
+                    break;
+                }
+                cell_y += step_y;
+                hit = next_y;
+                next_y += each_y;
+                if(solid(cell_x, cell_y)) {
+                    side = 1;
+                }
+            }
+        }
+
+        if(side < 0) {
+            x += dx;
+            y += dy;
+            break;
+        }
+
+        // Up to the edge on the blocked axis, then carry on with what is left of the other one
+        if(side == 0) {
+            x = (step_x > 0 ? cell_x : cell_x + 1) - step_x * EDGE_EPSILON;
+            y += dy * hit;
+            dx = 0;
+            dy *= 1 - hit;
+        } else {
+            y = (step_y > 0 ? cell_y : cell_y + 1) - step_y * EDGE_EPSILON;
+            x += dx * hit;
+            dy = 0;
+            dx *= 1 - hit;
+        }
+    }
+
+    // Keep a little room from neighbouring walls, so the camera can't press its face against one. Staying in the
+    // same cell, only the sides moved towards can have come closer; a new cell has all new neighbours. Either way
+    // a neighbour is only looked up when the camera is within the margin of it.
+    int cell_x = floor(x);
+    int cell_y = floor(y);
+    bool new_cell = cell_x != start_x || cell_y != start_y;
+    if((toward_left || new_cell) && x - cell_x < _wall_margin && solid(cell_x - 1, cell_y)) {
+        x = cell_x + _wall_margin;
+    } else if((toward_right || new_cell) && cell_x + 1 - x < _wall_margin && solid(cell_x + 1, cell_y)) {
+        x = cell_x + 1 - _wall_margin;
+    }
+    if((toward_top || new_cell) && y - cell_y < _wall_margin && solid(cell_x, cell_y - 1)) {
+        y = cell_y + _wall_margin;
+    } else if((toward_bottom || new_cell) && cell_y + 1 - y < _wall_margin && solid(cell_x, cell_y + 1)) {
+        y = cell_y + 1 - _wall_margin;
+    }
+
+    _current.x = x;
+    _current.y = y;
+}
@@ -0,0 +1,94 @@
+/**
+ *	Fixed-timestep camera movement for the raycaster engine. Nothing here touches Gosu, so it can run
+ *	headless - on a server validating replays, for instance - as fast as the CPU allows.
+ */
+#ifndef GOSU_RAYCAST_SIMULATION_HPP
+#define GOSU_RAYCAST_SIMULATION_HPP
+
+#include <functional>
+
+namespace Gosu {
+    // Everything about the camera that moves. Matches what RayCaster::setCameraState takes.
+    struct CameraState {
+        double x = 0;
+        double y = 0;
+        double dir_x = 0;           // Facing, as in RayCaster::getCoordinateSystem
+        double dir_y = -1;
+        double pitch = 0;           // As in RayCaster::setCameraPitch
+        double bob = 0;             // Current bob offset, stacks with pitch
+        int bob_direction = 1;
+        double height = 0.5;        // As in RayCaster::setCameraHeight
+    };
+
+    // What the player is asking for, held from tick to tick until it changes. Values are -1.0 to 1.0 and are
+    // multiplied by the simulation's speeds.
+    struct CameraInput {
+        double forward = 0;
+        double strafe = 0;          // Positive is to the right
+        double turn = 0;            // Positive turns right, like RayCaster::rotateCamera
+        double pitch = 0;
+    };
+
+    class CameraSimulation {
+    public:
+        // Whether the map cell at x, y blocks movement
+        typedef std::function<bool(int, int)> SolidQuery;
+
+        explicit CameraSimulation(const double ticks_per_second = 120.0);
+
+        // Jump straight to a state, with nothing to interpolate from
+        void setState(const CameraState& state);
+
+        // State as of the most recent tick
+        const CameraState& getState() const;
+
+        // Speeds are per second, so they don't change with the tick rate
+        void setWalkSpeed(const double units);
+        void setTurnSpeed(const double degrees);
+        void setPitchSpeed(const double amount);
+        void setBobSpeed(const double amount);
+
+        // How far the camera bobs while walking forward. See RayCaster::setCameraBobRange.
+        void setBobRange(const double amount);
+
+        // How close the camera may get to a solid cell
+        void setWallMargin(const double units);
+
+        void setInput(const CameraInput& input);
+
+        // Run as many whole ticks as fit into the time elapsed, carrying the remainder over to the next call.
+        // Returns the number of ticks run. A long stall is capped rather than simulated in full.
+        unsigned advance(const double seconds, const SolidQuery& solid);
+
+        // Run exactly one tick. Replays and servers drive the simulation with this directly.
+        void tick(const SolidQuery& solid);
+
+        // The state to render: partway between the last two ticks, by how much time is left over
+        CameraState interpolated() const;
+
+        unsigned long getTickCount() const;
+        double getTickLength() const;
+
+    private:
+        // Move by dx, dy, stopping at the first solid cell crossed and sliding along it
+        void _sweep(double dx, double dy, const SolidQuery& solid);
+
+    private:
+        double _tick_length;
+        double _accumulated;
+        unsigned long _ticks;
+
+        CameraState _previous;
+        CameraState _current;
+        CameraInput _input;
+
+        double _walk_speed;
+        double _turn_speed;
+        double _pitch_speed;
+        double _bob_speed;
+        double _bob_range;
+        double _wall_margin;
+    };
+};
+
+#endif
@@ -0,0 +1,284 @@
+#include "textures.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+// Size of a checkerboard square in the placeholder texture
+static const unsigned PLACEHOLDER_CHECK = 8;
+
+Gosu::TextureRegistry::TextureRegistry(const unsigned threads) {
+    _in_flight = 0;
+    _stopping = false;
+    _generation = 0;
+
+    // Placeholder is a dull checkerboard, so a missing texture is obvious without being garish
+    _placeholder_bitmap.resize(PLACEHOLDER_CHECK * 2, PLACEHOLDER_CHECK * 2);
+    for(unsigned y = 0; y < _placeholder_bitmap.height(); y++) {
+        for(unsigned x = 0; x < _placeholder_bitmap.width(); x++) {
+            bool dark = ((x / PLACEHOLDER_CHECK) + (y / PLACEHOLDER_CHECK)) % 2;
+            _placeholder_bitmap.setPixel(x, y, dark ? Gosu::Color(255, 64, 64, 64) : Gosu::Color(255, 128, 128, 128));
+        }
+    }
+
+    for(unsigned i = 0; i < (threads > 0 ? threads : 1); i++) {
+        _threads.push_back(std::thread(&TextureRegistry::_work, this));
+    }
+}
+
+Gosu::TextureRegistry::~TextureRegistry() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _wake.notify_all();
+
+    for(auto& thread: _threads) {
+        thread.join();
+    }
+}
+
+Gosu::TextureHandle Gosu::TextureRegistry::load(const std::wstring& filename) {
+    TextureHandle handle;
+
+    // Already known? Share it.
+    auto found = _by_filename.find(filename);
+    if(found != _by_filename.end()) {
+        handle.id = found->second;
+        return handle;
+    }
+
+    Entry * entry = new Entry;
+    entry->filename = filename;
+    entry->state = QUEUED;
+    _entries.push_back(std::unique_ptr<Entry>(entry));
+
+    handle.id = _entries.size();
+    _by_filename[filename] = handle.id;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queued.push_back(entry);
+        _in_flight++;
+    }
+    _wake.notify_one();
+
+    return handle;
+}
+
+void Gosu::TextureRegistry::update(const unsigned max_uploads) {
+    std::deque<Entry *> uploads;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        while(!_decoded.empty() && uploads.size() < max_uploads) {
+            uploads.push_back(_decoded.front());
+            _decoded.pop_front();
+        }
+    }
+
+    // Image creation talks to the graphics context, so it has to be here rather than on a worker
+    for(Entry * entry: uploads) {
+        entry->image.reset(new Gosu::Image(entry->bitmap));
+        entry->state = READY;
+    }
+}
+
+void Gosu::TextureRegistry::finish() {
+    while(!idle()) {
+        update(~0u);
+        std::this_thread::yield();
+    }
+}
+
+bool Gosu::TextureRegistry::ready(const TextureHandle handle) const {
+    Entry * entry = _entry(handle);
+    return entry && entry->state == READY;
+}
+
+bool Gosu::TextureRegistry::idle() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _in_flight == 0 && _decoded.empty();
+}
+
+void Gosu::TextureRegistry::unload(const TextureHandle handle) {
+    Entry * entry = _entry(handle);
+    if(entry == NULL || entry->state == UNLOADED) {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        // Take it out of line if it hasn't been decoded or uploaded yet. One that a worker is busy with is
+        // dropped by the worker when it finishes.
+        auto queued = std::find(_queued.begin(), _queued.end(), entry);
+        if(queued != _queued.end()) {
+            _queued.erase(queued);
+            _in_flight--;
+        }
+        _decoded.erase(std::remove(_decoded.begin(), _decoded.end(), entry), _decoded.end());
+        entry->state = UNLOADED;
+    }
+
+    _by_filename.erase(entry->filename);
+    entry->image.reset();
+    Gosu::Bitmap().swap(entry->bitmap);
+    _generation++;
+}
+
+void Gosu::TextureRegistry::clear() {
+    for(unsigned id = 1; id <= _entries.size(); id++) {
+        TextureHandle handle;
+        handle.id = id;
+        unload(handle);
+    }
+}
+
+unsigned long Gosu::TextureRegistry::getGeneration() const {
+    return _generation;
+}
+
+Gosu::Image * Gosu::TextureRegistry::image(const TextureHandle handle) {
+    Entry * entry = _entry(handle);
+    if(entry == NULL || entry->state == UNLOADED) {
+        return NULL;
+    } else if(entry->state == READY) {
+        return entry->image.get();
+    }
+
+    // Made lazily so that the registry itself can be constructed before the window exists
+    if(!_placeholder_image) {
+        _placeholder_image.reset(new Gosu::Image(_placeholder_bitmap));
+    }
+    return _placeholder_image.get();
+}
+
+Gosu::Bitmap * Gosu::TextureRegistry::bitmap(const TextureHandle handle) {
+    Entry * entry = _entry(handle);
+    if(entry == NULL || entry->state == UNLOADED) {
+        return NULL;
+    }
+    return entry->state == READY ? &entry->bitmap : &_placeholder_bitmap;
+}
+
+void Gosu::TextureRegistry::_work() {
+    while(true) {
+        Entry * entry;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wake.wait(lock, [this] { return _stopping || !_queued.empty(); });
+            if(_stopping) {
+                return;
+            }
+            entry = _queued.front();
+            _queued.pop_front();
+        }
+
+        // The slow part - disk and decode - happens outside the lock
+        Gosu::Bitmap decoded;
+        bool failed = false;
+        try {
+            Gosu::loadImageFile(decoded, entry->filename);
+        } catch(const std::exception&) {
+            failed = true;
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _in_flight--;
+        if(entry->state == UNLOADED) {
+            // Unloaded while it was being decoded; nobody wants it any more
+        } else if(failed) {
+            entry->state = FAILED;
+        } else {
+            entry->bitmap.swap(decoded);
+            entry->state = DECODED;
+            _decoded.push_back(entry);
+        }
+    }
+}
+
+Gosu::TextureRegistry::Entry * Gosu::TextureRegistry::_entry(const TextureHandle handle) const {
+    if(handle.id == 0 || handle.id > _entries.size()) {
+        return NULL;
+    }
+    return _entries[handle.id - 1].get();
+}
+
+Gosu::ProceduralTexture::ProceduralTexture(const unsigned width, const unsigned height, const Generator& generate, const double updates_per_second) {
+    _generate = generate;
+    _update_interval = updates_per_second > 0 ? 1.0 / updates_per_second : 0.0;
+    _last_update = 0;
+    _last_frame = 0;
+    _generated = false;
+
+    _texels.resize(width, height);
+    _dirty_left = _dirty_top = 0;
+    _dirty_right = _dirty_bottom = 0;
+}
+
+unsigned Gosu::ProceduralTexture::width() const {
+    return _texels.width();
+}
+
+unsigned Gosu::ProceduralTexture::height() const {
+    return _texels.height();
+}
+
+Gosu::Color Gosu::ProceduralTexture::texel(const unsigned x, const unsigned y) const {
+    return _texels.getPixel(x, y);
+}
+
+void Gosu::ProceduralTexture::setTexel(const unsigned x, const unsigned y, const Gosu::Color color) {
+    if(_texels.getPixel(x, y) == color) {
+        return;
+    }
+    _texels.setPixel(x, y, color);
+
+    // Grow the dirty rectangle to cover it
+    if(_dirty_right <= _dirty_left || _dirty_bottom <= _dirty_top) {
+        _dirty_left = x;
+        _dirty_top = y;
+        _dirty_right = x + 1;
+        _dirty_bottom = y + 1;
+    } else {
+        _dirty_left = std::min(_dirty_left, x);
+        _dirty_top = std::min(_dirty_top, y);
+        _dirty_right = std::max(_dirty_right, x + 1);
+        _dirty_bottom = std::max(_dirty_bottom, y + 1);
+    }
+}
+
+void Gosu::ProceduralTexture::refresh(const unsigned long frame, const double seconds) {
+    if(_generated && frame == _last_frame) {
+        return;
+    }
+    _last_frame = frame;
+
+    // A clock that went backwards - a replay starting over, say - counts as due
+    if(!_generated || seconds - _last_update >= _update_interval || seconds < _last_update) {
+        _last_update = seconds;
+        _generated = true;
+        _generate(*this, seconds);
+    }
+}
+
+Gosu::Image * Gosu::ProceduralTexture::image() {
+    if(!_generated) {
+        return NULL;
+    }
+
+    if(!_image) {
+        _image.reset(new Gosu::Image(_texels));
+    } else if(_dirty_right > _dirty_left && _dirty_bottom > _dirty_top) {
+        // Upload only the changed rectangle into the existing texture, rather than making a new image
+        Gosu::Bitmap changed(_dirty_right - _dirty_left, _dirty_bottom - _dirty_top);
+        changed.insert(_texels, 0, 0, _dirty_left, _dirty_top, changed.width(), changed.height());
+        _image->getData().insert(changed, _dirty_left, _dirty_top);
+    }
+    _dirty_left = _dirty_top = 0;
+    _dirty_right = _dirty_bottom = 0;
+    return _image.get();
+}
+
+Gosu::Bitmap * Gosu::ProceduralTexture::bitmap() {
+    return &_texels;
+}
@@ -0,0 +1,159 @@
+/**
+ *	Shared, asynchronously loaded textures for the raycaster engine
+ */
+#ifndef GOSU_RAYCAST_TEXTURES_HPP
+#define GOSU_RAYCAST_TEXTURES_HPP
+
+#include <Gosu/Gosu.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Gosu {
+    // A lightweight reference to a texture owned by a TextureRegistry. Copy it around freely - it stays
+    // valid for as long as the registry does, even before the texture has finished loading.
+    struct TextureHandle {
+        unsigned id = 0; // 0 is the null handle
+
+        bool valid() const { return id != 0; }
+    };
+
+    // A looping sequence of registry textures, for walls, floors or ceilings that animate. Every frame is
+    // uploaded once up front, so animating just picks which one to draw.
+    struct AnimatedTexture {
+        std::vector<TextureHandle> frames;
+        double frames_per_second = 8.0;
+    };
+
+    // A texture whose texels are generated in code - scrolling water, flickering panels and the like.
+    // The generator only runs for frames in which the texture is actually hit, and only the texels it
+    // changes are sent to the graphics card.
+    class ProceduralTexture {
+    public:
+        // Called with the texture and the time in seconds. Write texels with setTexel.
+        typedef std::function<void(ProceduralTexture& texture, const double seconds)> Generator;
+
+        // 'updates_per_second' limits how often the generator runs; 0 runs it every frame it is seen.
+        ProceduralTexture(const unsigned width, const unsigned height, const Generator& generate, const double updates_per_second = 30.0);
+
+        unsigned width() const;
+        unsigned height() const;
+
+        Gosu::Color texel(const unsigned x, const unsigned y) const;
+
+        // Only marks the texel for upload if the color actually changes
+        void setTexel(const unsigned x, const unsigned y, const Gosu::Color color);
+
+        // Run the generator if it is due. The renderer calls this when the texture is hit; calling it again in
+        // the same frame does nothing.
+        void refresh(const unsigned long frame, const double seconds);
+
+        // The texture for walls, and for floors and ceilings. The image is only made, and changed texels only
+        // uploaded to it, when it is asked for - so a texture used only on floors and ceilings never touches the
+        // graphics card. NULL before the first refresh.
+        Gosu::Image * image();
+        Gosu::Bitmap * bitmap();
+
+    private:
+        Generator _generate;
+        double _update_interval;
+        double _last_update;
+        unsigned long _last_frame;
+        bool _generated;            // The generator has run at least once
+
+        Gosu::Bitmap _texels;
+        std::unique_ptr<Gosu::Image> _image;
+
+        // Rectangle of texels changed since the image was last brought up to date; empty when right <= left
+        unsigned _dirty_left, _dirty_top, _dirty_right, _dirty_bottom;
+    };
+
+    class TextureRegistry {
+    public:
+        // Decoding happens on this many background threads
+        explicit TextureRegistry(const unsigned threads = 2);
+        ~TextureRegistry();
+
+        // Queue a texture for loading and return its handle straight away. Loading the same file twice
+        // hands back the same handle, so every user of that file shares one decoded copy.
+        TextureHandle load(const std::wstring& filename);
+
+        // Call once per frame from the thread that owns the window (Gosu::Window::update is ideal).
+        // Decoded bitmaps are turned into images here, at most 'max_uploads' of them per call so that
+        // a level full of new textures doesn't hitch a single frame.
+        void update(const unsigned max_uploads = 4);
+
+        // Block until every queued texture is ready. Only for tools; games should just keep rendering.
+        void finish();
+
+        // True once the texture can be drawn as itself rather than the placeholder
+        bool ready(const TextureHandle handle) const;
+
+        // True when nothing is left decoding or waiting for upload
+        bool idle() const;
+
+        // Free a texture's bitmap and image, for instance when leaving a level. The handle - and every copy of it -
+        // is invalid from then on: image and bitmap return NULL for it, as for the null handle. Loading the same
+        // file again makes a fresh copy under a new handle. Unloading a texture that is still decoding is fine.
+        void unload(const TextureHandle handle);
+
+        // Unload every texture, invalidating every handle this registry has handed out
+        void clear();
+
+        // Goes up whenever textures are unloaded. RayCaster watches it to drop sprite stripes cut from them.
+        unsigned long getGeneration() const;
+
+        // The texture as an image (walls, sprites) or bitmap (floors, ceilings). Until the texture is ready
+        // - or forever, if the file failed to load - these return a shared checkerboard placeholder.
+        // Null and unloaded handles return NULL.
+        Gosu::Image * image(const TextureHandle handle);
+        Gosu::Bitmap * bitmap(const TextureHandle handle);
+
+    private:
+        enum State {
+            QUEUED = 0,
+            DECODED,    // Bitmap is filled, image still needs to be made on the main thread
+            READY,
+            FAILED,
+            UNLOADED    // Freed; the entry stays only so that stale handles don't dangle
+        };
+
+        struct Entry {
+            std::wstring filename;
+            Gosu::Bitmap bitmap;
+            std::unique_ptr<Gosu::Image> image;
+            std::atomic<int> state;
+        };
+
+        void _work();
+        Entry * _entry(const TextureHandle handle) const;
+
+    private:
+        // Entries are indexed by handle id - 1 and are never removed, so handles never dangle. Unloading frees
+        // what an entry holds but leaves the entry itself.
+        std::deque<std::unique_ptr<Entry>> _entries;
+        std::map<std::wstring, unsigned> _by_filename;
+        unsigned long _generation;
+
+        // Work shared with the decoding threads
+        mutable std::mutex _mutex;
+        std::condition_variable _wake;
+        std::deque<Entry *> _queued;
+        std::deque<Entry *> _decoded;
+        unsigned _in_flight;
+        bool _stopping;
+        std::vector<std::thread> _threads;
+
+        Gosu::Bitmap _placeholder_bitmap;
+        std::unique_ptr<Gosu::Image> _placeholder_image;
+    };
+};
+
+#endif